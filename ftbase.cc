@@ -1,5 +1,108 @@
 #include "ftbase.hh"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// Arena
+//-----------------------------------------------------------------------------
+
+void* Arena::PushBytes(usize size, usize align)
+{
+  if (cur) {
+    // Block data follows the header
+    const uintptr_t base = (uintptr_t)(cur + 1);
+    const uintptr_t p    = (base + cur->used + align - 1) & ~(uintptr_t)(align - 1);
+    if (p + size <= base + cur->cap) {
+      cur->used = p + size - base;
+      return (void*)p;
+    }
+  }
+
+  // The rest of the current block is wasted, which is fine for scratch. Reuse
+  // the first dropped block that fits before allocating a new one
+  const usize need = size + align;
+  ArenaBlock** link = &spare;
+  while (*link && (*link)->cap < need) {
+    link = &(*link)->prev;
+  }
+  ArenaBlock* block = *link;
+  if (block) {
+    *link = block->prev;
+  } else {
+    const usize min_cap = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    const usize cap     = Max(min_cap, need);
+    block = (ArenaBlock*)MemAlloc<u8>(sizeof(ArenaBlock) + cap);
+    block->cap = cap;
+  }
+  block->prev = cur;
+  block->used = 0;
+  cur = block;
+  return PushBytes(size, align);
+}
+
+void Arena::Shrink(void* mem, usize old_size, usize new_size)
+{
+  SDL_assert(new_size <= old_size);
+  if (cur && (u8*)mem + old_size == (u8*)(cur + 1) + cur->used) {
+    cur->used -= old_size - new_size;
+  }
+}
+
+void Arena::Reset(ArenaMark mark)
+{
+  // Keep the oldest block as cur when emptying, so an empty arena still has
+  // somewhere to push
+  while (cur && cur != mark.block && (mark.block || cur->prev)) {
+    ArenaBlock* prev = cur->prev;
+    cur->prev = spare;
+    spare = cur;
+    cur = prev;
+  }
+  if (cur) {
+    cur->used = mark.used;
+  }
+}
+
+static void FreeArenaBlocks(ArenaBlock* block)
+{
+  while (block) {
+    ArenaBlock* prev = block->prev;
+    MemFree(block);
+    block = prev;
+  }
+}
+
+void Arena::Destroy()
+{
+  FreeArenaBlocks(cur);
+  FreeArenaBlocks(spare);
+  cur   = NULL;
+  spare = NULL;
+}
+
+struct ScratchArena
+{
+  Arena arena;
+
+  ~ScratchArena() { arena.Destroy(); }
+};
+
+Arena* GetScratchArena()
+{
+  static thread_local ScratchArena scratch = { };
+  return &scratch.arena;
+}
+
 //-----------------------------------------------------------------------------
 // String helpers
 //-----------------------------------------------------------------------------
@@ -31,7 +134,8 @@ bool WildcardMatch(const char* pattern, const char* str)
   return !*p;
 }
 
-bool IsValidUTF8(Span<u8> data)
+// Reference version, one byte at a time
+static bool IsValidUTF8Scalar(Span<u8> data)
 {
   usize i = 0;
   while (i < data.len) {
@@ -185,6 +289,243 @@ bool IsValidUTF8(Span<u8> data)
   return true;
 }
 
+#if defined(SDL_SSE4_1_INTRINSICS) || defined(SDL_AVX2_INTRINSICS)
+
+// Lookup-table validation from "Validating UTF-8 In Less Than One Instruction
+// Per Byte" (Keiser, Lemire), as used in simdjson. The high nibble of the
+// previous byte, its low nibble and the high nibble of the current byte each
+// select a set of errors that pair of bytes could be part of. ANDed together
+// they are nonzero only for an actual error. 3 and 4-byte sequences that are
+// missing continuations are caught separately with prev2/prev3
+
+#define UTF8_TOO_SHORT      (1 << 0) // Lead byte followed by lead or ASCII
+#define UTF8_TOO_LONG       (1 << 1) // ASCII followed by continuation
+#define UTF8_OVERLONG_3     (1 << 2) // E0 [80, 9F]
+#define UTF8_TOO_LARGE      (1 << 3) // [F4, FF] [90, BF]
+#define UTF8_SURROGATE      (1 << 4) // ED [A0, BF]
+#define UTF8_OVERLONG_2     (1 << 5) // [C0, C1] [80, BF]
+#define UTF8_TOO_LARGE_1000 (1 << 6) // [F5, FF] [80, 8F]
+#define UTF8_OVERLONG_4     (1 << 6) // F0 [80, 8F]
+#define UTF8_TWO_CONTS      (1 << 7) // Continuation after continuation
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+alignas(16) static const u8 UTF8_BYTE_1_HIGH[16] = {
+  // ASCII
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  // Continuation
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  // [C0, CF]
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  // [D0, DF]
+  UTF8_TOO_SHORT,
+  // [E0, EF]
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  // [F0, FF]
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+};
+
+alignas(16) static const u8 UTF8_BYTE_1_LOW[16] = {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+};
+
+alignas(16) static const u8 UTF8_BYTE_2_HIGH[16] = {
+  // ASCII
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  // [80, 8F]
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  // [90, 9F]
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE,
+  // [A0, BF]
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+  // Lead bytes
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+};
+
+// Largest value of each of the last three bytes of a block that doesn't
+// start a sequence running past the block
+alignas(32) static const u8 UTF8_MAX_VALUE[32] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+#endif // SDL_SSE4_1_INTRINSICS || SDL_AVX2_INTRINSICS
+
+#ifdef SDL_SSE4_1_INTRINSICS
+
+struct UTF8StateSSE41
+{
+  __m128i error;
+  __m128i prev_input;
+  __m128i prev_incomplete;
+};
+
+SDL_TARGETING("sse4.1")
+static inline void UTF8_CheckSSE41(UTF8StateSSE41* st, __m128i input)
+{
+  if (!_mm_movemask_epi8(input)) {
+    // Only a sequence left open by the previous block can fail here
+    st->error = _mm_or_si128(st->error, st->prev_incomplete);
+    st->prev_incomplete = _mm_setzero_si128();
+    st->prev_input = input;
+    return;
+  }
+
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i prev1 = _mm_alignr_epi8(input, st->prev_input, 15);
+  const __m128i prev2 = _mm_alignr_epi8(input, st->prev_input, 14);
+  const __m128i prev3 = _mm_alignr_epi8(input, st->prev_input, 13);
+
+  const __m128i byte_1_high = _mm_shuffle_epi8(
+    _mm_load_si128((const __m128i*)UTF8_BYTE_1_HIGH),
+    _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  const __m128i byte_1_low = _mm_shuffle_epi8(
+    _mm_load_si128((const __m128i*)UTF8_BYTE_1_LOW),
+    _mm_and_si128(prev1, nibble));
+  const __m128i byte_2_high = _mm_shuffle_epi8(
+    _mm_load_si128((const __m128i*)UTF8_BYTE_2_HIGH),
+    _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+  const __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  // Bytes 2 and 3 after a 3 or 4-byte lead must be continuations
+  const __m128i is_third  = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+  const __m128i is_fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+  const __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char)0x80));
+
+  st->error = _mm_or_si128(st->error, _mm_xor_si128(must23, special));
+  st->prev_incomplete = _mm_subs_epu8(input, _mm_load_si128((const __m128i*)(UTF8_MAX_VALUE + 16)));
+  st->prev_input = input;
+}
+
+SDL_TARGETING("sse4.1")
+static bool IsValidUTF8SSE41(Span<u8> data)
+{
+  UTF8StateSSE41 st = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+  usize i = 0;
+  for (; i + 16 <= data.len; i += 16) {
+    UTF8_CheckSSE41(&st, _mm_loadu_si128((const __m128i*)(data.buf + i)));
+  }
+  if (i < data.len) {
+    // Zero padding reads as ASCII
+    alignas(16) u8 tail[16] = { };
+    SDL_memcpy(tail, data.buf + i, data.len - i);
+    UTF8_CheckSSE41(&st, _mm_load_si128((const __m128i*)tail));
+  }
+  st.error = _mm_or_si128(st.error, st.prev_incomplete);
+  return _mm_testz_si128(st.error, st.error);
+}
+
+#endif // SDL_SSE4_1_INTRINSICS
+
+#ifdef SDL_AVX2_INTRINSICS
+
+struct UTF8StateAVX2
+{
+  __m256i error;
+  __m256i prev_input;
+  __m256i prev_incomplete;
+};
+
+SDL_TARGETING("avx2")
+static inline void UTF8_CheckAVX2(UTF8StateAVX2* st, __m256i input)
+{
+  if (!_mm256_movemask_epi8(input)) {
+    // Only a sequence left open by the previous block can fail here
+    st->error = _mm256_or_si256(st->error, st->prev_incomplete);
+    st->prev_incomplete = _mm256_setzero_si256();
+    st->prev_input = input;
+    return;
+  }
+
+  // alignr works within 128-bit lanes, so pair each lane with the one before
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i shifted = _mm256_permute2x128_si256(st->prev_input, input, 0x21);
+  const __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+  const __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+  const __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+  const __m256i byte_1_high = _mm256_shuffle_epi8(
+    _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)UTF8_BYTE_1_HIGH)),
+    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+  const __m256i byte_1_low = _mm256_shuffle_epi8(
+    _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)UTF8_BYTE_1_LOW)),
+    _mm256_and_si256(prev1, nibble));
+  const __m256i byte_2_high = _mm256_shuffle_epi8(
+    _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)UTF8_BYTE_2_HIGH)),
+    _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+  const __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+  // Bytes 2 and 3 after a 3 or 4-byte lead must be continuations
+  const __m256i is_third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+  const __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+  const __m256i must23 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+
+  st->error = _mm256_or_si256(st->error, _mm256_xor_si256(must23, special));
+  st->prev_incomplete = _mm256_subs_epu8(input, _mm256_load_si256((const __m256i*)UTF8_MAX_VALUE));
+  st->prev_input = input;
+}
+
+SDL_TARGETING("avx2")
+static bool IsValidUTF8AVX2(Span<u8> data)
+{
+  UTF8StateAVX2 st = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+  usize i = 0;
+  for (; i + 32 <= data.len; i += 32) {
+    UTF8_CheckAVX2(&st, _mm256_loadu_si256((const __m256i*)(data.buf + i)));
+  }
+  if (i < data.len) {
+    // Zero padding reads as ASCII
+    alignas(32) u8 tail[32] = { };
+    SDL_memcpy(tail, data.buf + i, data.len - i);
+    UTF8_CheckAVX2(&st, _mm256_load_si256((const __m256i*)tail));
+  }
+  st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+  return _mm256_testz_si256(st.error, st.error);
+}
+
+#endif // SDL_AVX2_INTRINSICS
+
+bool IsValidUTF8(Span<u8> data)
+{
+#ifdef SDL_AVX2_INTRINSICS
+  static const bool has_avx2 = SDL_HasAVX2();
+  if (has_avx2) {
+    return IsValidUTF8AVX2(data);
+  }
+#endif
+#ifdef SDL_SSE4_1_INTRINSICS
+  // pshufb is SSSE3, which SDL has no check for
+  static const bool has_sse41 = SDL_HasSSE41();
+  if (has_sse41) {
+    return IsValidUTF8SSE41(data);
+  }
+#endif
+  return IsValidUTF8Scalar(data);
+}
+
 //-----------------------------------------------------------------------------
 // Path helpers
 //-----------------------------------------------------------------------------
@@ -237,3 +578,348 @@ const char* Extension(const char* path)
 
   return end_part;
 }
+
+const char* BaseName(const char* path)
+{
+  const char* base = path;
+  for (const char* p = path; *p; ++p) {
+    if (IsDelim(*p)) {
+      base = p + 1;
+    }
+  }
+  return base;
+}
+
+
+//-----------------------------------------------------------------------------
+// File mapping
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+bool MapFile(MappedFile* map, const char* path)
+{
+  *map = { };
+
+  wchar_t* wpath = (wchar_t*)SDL_iconv_string("UTF-16LE", "UTF-8", path,
+                                              SDL_strlen(path) + 1);
+  if (!wpath) {
+    return false;
+  }
+  defer { SDL_free(wpath); };
+
+  HANDLE file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return SDL_SetError("Couldn't open %s", path);
+  }
+
+  LARGE_INTEGER size = { };
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return SDL_SetError("Couldn't get size of %s", path);
+  }
+
+  // Can't create a mapping for an empty file
+  if (size.QuadPart == 0) {
+    CloseHandle(file);
+    return true;
+  }
+
+  HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) {
+    CloseHandle(file);
+    return SDL_SetError("Couldn't map %s", path);
+  }
+
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return SDL_SetError("Couldn't map %s", path);
+  }
+
+  map->data    = Span<const u8>((const u8*)view, (usize)size.QuadPart);
+  map->file    = file;
+  map->mapping = mapping;
+  return true;
+}
+
+void UnmapFile(MappedFile* map)
+{
+  if (map->data.buf) {
+    UnmapViewOfFile(map->data.buf);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+  }
+  *map = { };
+}
+
+#else
+
+bool MapFile(MappedFile* map, const char* path)
+{
+  *map = { };
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return SDL_SetError("Couldn't open %s: %s", path, strerror(errno));
+  }
+  // The mapping stays valid after the descriptor is closed
+  defer { close(fd); };
+
+  struct stat st = { };
+  if (fstat(fd, &st) < 0) {
+    return SDL_SetError("Couldn't stat %s: %s", path, strerror(errno));
+  }
+
+  // mmap() rejects zero-length mappings
+  if (st.st_size == 0) {
+    return true;
+  }
+
+  void* view = mmap(NULL, (usize)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (view == MAP_FAILED) {
+    return SDL_SetError("Couldn't map %s: %s", path, strerror(errno));
+  }
+
+  map->data = Span<const u8>((const u8*)view, (usize)st.st_size);
+  return true;
+}
+
+void UnmapFile(MappedFile* map)
+{
+  if (map->data.buf) {
+    munmap((void*)map->data.buf, map->data.len);
+  }
+  *map = { };
+}
+
+#endif
+
+Span<const u8> ViewIO(SDL_IOStream* io)
+{
+  SDL_PropertiesID props = SDL_GetIOProperties(io);
+  const u8* mem = (const u8*)SDL_GetPointerProperty(props, SDL_PROP_IOSTREAM_MEMORY_POINTER, NULL);
+  if (!mem) {
+    return { };
+  }
+  const Sint64 mem_len = SDL_GetNumberProperty(props, SDL_PROP_IOSTREAM_MEMORY_SIZE_NUMBER, 0);
+  const Sint64 pos = SDL_TellIO(io);
+  if (pos < 0 || pos > mem_len) {
+    return { };
+  }
+  return Span<const u8>(mem + pos, (usize)(mem_len - pos));
+}
+
+bool ReadIOAt(SDL_IOStream* io, u64 off, void* dst, usize len)
+{
+  SDL_PropertiesID props = SDL_GetIOProperties(io);
+
+  // Memory streams
+  const u8* mem = (const u8*)SDL_GetPointerProperty(props, SDL_PROP_IOSTREAM_MEMORY_POINTER, NULL);
+  if (mem) {
+    u64 mem_len = (u64)SDL_GetNumberProperty(props, SDL_PROP_IOSTREAM_MEMORY_SIZE_NUMBER, 0);
+    if (off > mem_len || mem_len - off < len) {
+      return SDL_SetError("Read out of bounds");
+    }
+    SDL_memcpy(dst, mem + off, len);
+    return true;
+  }
+
+#ifdef _WIN32
+  HANDLE file = (HANDLE)SDL_GetPointerProperty(props, SDL_PROP_IOSTREAM_WINDOWS_HANDLE_POINTER,
+                                               NULL);
+  if (file) {
+    u8* p = (u8*)dst;
+    while (len > 0) {
+      OVERLAPPED ov = { };
+      ov.Offset     = (DWORD)off;
+      ov.OffsetHigh = (DWORD)(off >> 32);
+      DWORD chunk = (DWORD)Min<usize>(len, 0x40000000);
+      DWORD nread = 0;
+      if (!ReadFile(file, p, chunk, &nread, &ov) || nread == 0) {
+        return SDL_SetError("Couldn't read file");
+      }
+      p   += nread;
+      off += nread;
+      len -= nread;
+    }
+    return true;
+  }
+#else
+  FILE* fp = (FILE*)SDL_GetPointerProperty(props, SDL_PROP_IOSTREAM_STDIO_FILE_POINTER, NULL);
+  if (fp) {
+    const int fd = fileno(fp);
+    u8* p = (u8*)dst;
+    while (len > 0) {
+      ssize_t nread = pread(fd, p, len, (off_t)off);
+      if (nread < 0 && errno == EINTR) {
+        continue;
+      }
+      if (nread <= 0) {
+        return SDL_SetError("Couldn't read file: %s",
+                            nread < 0 ? strerror(errno) : "unexpected end of file");
+      }
+      p   += nread;
+      off += nread;
+      len -= nread;
+    }
+    return true;
+  }
+#endif
+
+  if (SDL_SeekIO(io, (Sint64)off, SDL_IO_SEEK_SET) < 0) {
+    return false;
+  }
+  return SDL_ReadIO(io, dst, len) == len;
+}
+
+bool CopyIO(SDL_IOStream* dst, SDL_IOStream* src, u64 len)
+{
+  const usize buf_len = 64 * 1024;
+  u8* buf = MemAlloc<u8>(buf_len);
+  defer { MemFree(buf); };
+
+  while (len > 0) {
+    const usize chunk = (usize)Min<u64>(len, buf_len);
+    if (SDL_ReadIO(src, buf, chunk) != chunk) {
+      return false;
+    }
+    if (SDL_WriteIO(dst, buf, chunk) != chunk) {
+      return false;
+    }
+    len -= chunk;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Thread pool
+//-----------------------------------------------------------------------------
+
+struct ThreadPoolWorker
+{
+  ThreadPool* pool;
+  SDL_Thread* thread;
+  u32         id;
+};
+
+static void RunPoolJob(ThreadPool* pool, u32 worker)
+{
+  for (;;) {
+    const u32 idx = (u32)SDL_AddAtomicInt(&pool->next, 1);
+    if (idx >= pool->count) {
+      break;
+    }
+    pool->func(pool->user, idx, worker);
+  }
+}
+
+static int PoolWorkerMain(void* arg)
+{
+  ThreadPoolWorker* worker = (ThreadPoolWorker*)arg;
+  ThreadPool* pool = worker->pool;
+
+  u32 seen = 0;
+  SDL_LockMutex(pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->generation == seen) {
+      SDL_WaitCondition(pool->wake, pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->generation;
+    SDL_UnlockMutex(pool->lock);
+
+    RunPoolJob(pool, worker->id);
+
+    SDL_LockMutex(pool->lock);
+    if (--pool->busy == 0) {
+      SDL_SignalCondition(pool->done);
+    }
+  }
+  SDL_UnlockMutex(pool->lock);
+  return 0;
+}
+
+bool CreateThreadPool(ThreadPool* pool, u32 nworkers)
+{
+  SDL_memset(pool, 0, sizeof(*pool));
+  if (nworkers == 0) {
+    nworkers = (u32)Max(SDL_GetNumLogicalCPUCores(), 1);
+  }
+  if (nworkers == 1) {
+    return true;
+  }
+
+  pool->lock = SDL_CreateMutex();
+  pool->wake = SDL_CreateCondition();
+  pool->done = SDL_CreateCondition();
+  if (!pool->lock || !pool->wake || !pool->done) {
+    pool->Destroy();
+    return false;
+  }
+
+  pool->workers = MemAllocZ<ThreadPoolWorker>(nworkers - 1);
+  for (u32 i = 0; i < nworkers - 1; ++i) {
+    ThreadPoolWorker* worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->id   = i + 1;
+    worker->thread = SDL_CreateThread(PoolWorkerMain, "ftpool", worker);
+    if (!worker->thread) {
+      pool->Destroy();
+      return false;
+    }
+    ++pool->nthreads;
+  }
+
+  return true;
+}
+
+void ThreadPool::ParallelFor(u32 count, ParallelForFunc func, void* user)
+{
+  if (nthreads == 0 || count <= 1) {
+    for (u32 i = 0; i < count; ++i) {
+      func(user, i, 0);
+    }
+    return;
+  }
+
+  SDL_LockMutex(lock);
+  this->func  = func;
+  this->user  = user;
+  this->count = count;
+  SDL_SetAtomicInt(&next, 0);
+  busy = nthreads;
+  ++generation;
+  SDL_BroadcastCondition(wake);
+  SDL_UnlockMutex(lock);
+
+  RunPoolJob(this, 0);
+
+  SDL_LockMutex(lock);
+  while (busy > 0) {
+    SDL_WaitCondition(done, lock);
+  }
+  SDL_UnlockMutex(lock);
+}
+
+void ThreadPool::Destroy()
+{
+  if (nthreads > 0) {
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_BroadcastCondition(wake);
+    SDL_UnlockMutex(lock);
+    for (u32 i = 0; i < nthreads; ++i) {
+      SDL_WaitThread(workers[i].thread, NULL);
+    }
+  }
+  MemFree(workers);
+  SDL_DestroyCondition(done);
+  SDL_DestroyCondition(wake);
+  SDL_DestroyMutex(lock);
+  SDL_memset(this, 0, sizeof(*this));
+}
@@ -121,6 +121,71 @@ static inline void MemFree(T* mem)
   SDL_free(mem);
 }
 
+//-----------------------------------------------------------------------------
+// Arena
+//-----------------------------------------------------------------------------
+
+#define ARENA_DEFAULT_BLOCK_SIZE (1 << 20)
+
+struct ArenaBlock
+{
+  ArenaBlock* prev;
+  usize       cap;
+  usize       used;
+};
+
+// Position in an arena to go back to, see Arena::Reset
+struct ArenaMark
+{
+  ArenaBlock* block;
+  usize       used;
+};
+
+// Linear allocator for scratch memory. Pushes are carved out of blocks of at
+// least block_size bytes and are only given back together by Reset. Blocks
+// dropped by Reset are kept for later pushes until Destroy. A
+// zero-initialized arena is ready to use. Not thread-safe
+struct Arena
+{
+  ArenaBlock* cur;
+  ArenaBlock* spare;      // Blocks dropped by Reset, linked through prev
+  usize       block_size; // 0 for ARENA_DEFAULT_BLOCK_SIZE
+
+  void* PushBytes(usize size, usize align);
+
+  template <typename T>
+  T* Push(usize count = 1)
+  {
+    return (T*)PushBytes(sizeof(T) * count, alignof(T));
+  }
+
+  template <typename T>
+  T* PushZ(usize count = 1)
+  {
+    T* mem = Push<T>(count);
+    SDL_memset(mem, 0, sizeof(T) * count);
+    return mem;
+  }
+
+  // Shrink the last push from old_size to new_size bytes, giving the rest
+  // back. Does nothing if mem wasn't the last push
+  void Shrink(void* mem, usize old_size, usize new_size);
+
+  ArenaMark Mark() const
+  {
+    return { cur, cur ? cur->used : 0 };
+  }
+
+  // Drop everything pushed since mark. The default mark empties the arena
+  void Reset(ArenaMark mark = { });
+  void Destroy();
+};
+
+// Per-thread arena for short-lived scratch memory, safe to use from pool
+// workers. Take a Mark and Reset to it when done so nested users don't
+// disturb each other. Freed when the thread exits
+Arena* GetScratchArena();
+
 //-----------------------------------------------------------------------------
 // Span
 //-----------------------------------------------------------------------------
@@ -148,6 +213,13 @@ public:
   {
   }
 
+  // Span<T> converts to Span<const T>
+  template <typename U>
+  Span(Span<U> other)
+    : buf(other.buf), len(other.len)
+  {
+  }
+
   inline T& Get(usize idx)
   {
     SDL_assert_paranoid(buf && idx < len);
@@ -170,6 +242,69 @@ public:
   }
 };
 
+//-----------------------------------------------------------------------------
+// Byte reader
+//-----------------------------------------------------------------------------
+
+// Bounds-checked cursor over a block of memory. A read that would run past
+// the end fails without moving the cursor
+struct ByteReader
+{
+public:
+  const u8* pos;
+  const u8* end;
+public:
+  ByteReader(Span<const u8> data)
+    : pos(data.buf), end(data.buf + data.len)
+  {
+  }
+
+  inline usize Remaining() const
+  {
+    return end - pos;
+  }
+
+  // Pointer to the next len bytes, or NULL if there aren't enough
+  inline const u8* Take(usize len)
+  {
+    if (Remaining() < len) {
+      SDL_SetError("Unexpected end of data");
+      return NULL;
+    }
+    const u8* result = pos;
+    pos += len;
+    return result;
+  }
+
+  inline bool Skip(usize len)
+  {
+    return Take(len) != NULL;
+  }
+
+  inline bool Read(void* dst, usize len)
+  {
+    const u8* src = Take(len);
+    if (src) {
+      SDL_memcpy(dst, src, len);
+    }
+    return src != NULL;
+  }
+
+  inline bool ReadU8(u8* v)
+  {
+    return Read(v, 1);
+  }
+
+  inline bool ReadU32LE(u32* v)
+  {
+    const u8* p = Take(4);
+    if (p) {
+      *v = p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+    }
+    return p != NULL;
+  }
+};
+
 //-----------------------------------------------------------------------------
 // String helpers
 //-----------------------------------------------------------------------------
@@ -185,5 +320,74 @@ bool IsValidUTF8(Span<u8> data);
 
 const char* ExpandPath(const char* path);
 const char* Extension(const char* path);
+const char* BaseName(const char* path);
+
+//-----------------------------------------------------------------------------
+// File mapping
+//-----------------------------------------------------------------------------
+
+struct MappedFile
+{
+  Span<const u8> data; // Read-only
+#ifdef _WIN32
+  void*          file;
+  void*          mapping;
+#endif
+};
+
+// Map an entire file into memory, read-only
+bool MapFile(MappedFile* map, const char* path);
+void UnmapFile(MappedFile* map);
+
+// Read len bytes at off without using the stream's cursor, so several
+// threads can share one file. Streams without a native file handle fall back
+// to seek+read, which is not thread-safe
+bool ReadIOAt(SDL_IOStream* io, u64 off, void* dst, usize len);
+
+// View the unread part of a memory stream without copying it. Empty for
+// other streams. The memory may be const, so the view is read-only
+Span<const u8> ViewIO(SDL_IOStream* io);
+
+// Copy len bytes from src to dst through a fixed-size buffer
+bool CopyIO(SDL_IOStream* dst, SDL_IOStream* src, u64 len);
+
+//-----------------------------------------------------------------------------
+// Thread pool
+//-----------------------------------------------------------------------------
+
+// Called once for every index in [0, count). worker is in
+// [0, ThreadPool::WorkerCount()) and identifies the calling thread
+typedef void (*ParallelForFunc)(void* user, u32 idx, u32 worker);
+
+struct ThreadPoolWorker;
+
+struct ThreadPool
+{
+  ThreadPoolWorker* workers;
+  u32               nthreads; // Not counting the thread calling ParallelFor
+  SDL_Mutex*        lock;
+  SDL_Condition*    wake;
+  SDL_Condition*    done;
+  u32               generation;
+  u32               busy;
+  bool              quit;
+
+  // Current job
+  ParallelForFunc   func;
+  void*             user;
+  u32               count;
+  SDL_AtomicInt     next;
+
+  u32  WorkerCount() const { return nthreads + 1; }
+
+  // Run func over [0, count) and wait for it to finish. The calling thread
+  // takes part as worker 0. Not reentrant
+  void ParallelFor(u32 count, ParallelForFunc func, void* user);
+  void Destroy();
+};
+
+// Create a pool with nworkers workers including the caller, 0 for one per
+// logical core. A single-worker pool runs everything on the calling thread
+bool CreateThreadPool(ThreadPool* pool, u32 nworkers = 0);
 
 #endif // _FTECH_BASE_H_
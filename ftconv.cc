@@ -9,8 +9,8 @@ Command-line utility to pack, unpack, and convert game files for:
  - Neon Genesis Evangelion: Girlfriend of Steel (Special Edition) (2006, PC)
 
 Supported conversions:
-  .bin (2006): unpack
-  .lb5 (2006): unpack
+  .bin (2006): pack, unpack
+  .lb5 (2006): pack, unpack
 
   .bp2 (1997): decode
   .bp3 (2006): decode
@@ -18,11 +18,14 @@ Supported conversions:
   .txt (2006): decode
 
 Options:
-  --1997  Target 1997 game when encoding txt
-  --help  Display this text
-  --ls    List archive contents without unpacking
-  --raw   Don't convert inner formats when packing or unpacking
-  --yes   Overwrite existing files
+  --1997     Target 1997 game when encoding txt
+  --compact  Rewrite an archive without the gaps left by updating it
+  --help     Display this text
+  --jobs N   Unpack or decode using N threads, 0 for one per CPU core (default: 1)
+  --ls       List archive contents without unpacking
+  --raw      Don't convert inner formats when packing or unpacking
+  --update   Add or replace files in an existing archive instead of recreating it
+  --yes      Overwrite existing files
 
 Examples:
   ftconv event2048.lb5
@@ -33,21 +36,32 @@ Examples:
 
   ftconv face1024.lb5[ASUKA.*] asuka_faces/
     Unpack and convert all files starting with "ASUKA" from face1024.lb5 to asuka_faces/
+
+  ftconv --raw *.txt my_txt.lb5
+    Pack some text files as my_txt.lb5
+
+  ftconv --raw test.bmp face1024.lb5[GENDO.bmp]
+    Replace GENDO.bmp in face1024.lb5 with test.bmp without rebuilding the archive
 )";
 
 // NOT IMPLEMENTED:
 //
+// Converting while packing. Packing, and replacing single entries as in
+// "ftconv --raw test.bmp face1024.lb5[GENDO.bmp]", only work with --raw:
+//
 // ftconv test.bmp face1024.lb5[GENDO.bmp]
-//   Convert test.bmp and pack it in face1024.lb5 as GENDO.bmp
+//   Convert test.bmp to BP3 and replace GENDO.bmp in face1024.lb5 with it
 //
 // ftconv *.txt my_txt.lb5
 //   Convert and pack some text files as my_txt.lb5
 
 enum : u8 {
-  OPT_1997 = 1 << 0,
-  OPT_LS   = 1 << 1,
-  OPT_RAW  = 1 << 2,
-  OPT_YES  = 1 << 3,
+  OPT_1997    = 1 << 0,
+  OPT_LS      = 1 << 1,
+  OPT_RAW     = 1 << 2,
+  OPT_YES     = 1 << 3,
+  OPT_UPDATE  = 1 << 4,
+  OPT_COMPACT = 1 << 5,
 };
 
 enum : u8 {
@@ -78,11 +92,79 @@ struct File
 static struct
 {
   u8          options;
+  u32         jobs;
   Span<File>  files;
   File*       first_file;
   File*       last_file;
 } G = { };
 
+// Subscripts without wildcards name a single entry and can use the index
+static bool IsWildcard(const char* pattern)
+{
+  return SDL_strchr(pattern, '*') || SDL_strchr(pattern, '?');
+}
+
+// Entries of pack selected by subscript, as [*begin, *end)
+static bool SelectEntries(PackFile* pack, const char* subscript,
+                          PackEntry** begin, PackEntry** end)
+{
+  if (subscript && !IsWildcard(subscript)) {
+    *begin = pack->FindEntry(subscript);
+    if (!*begin) {
+      return SDL_SetError("No entry named %s", subscript);
+    }
+    *end = *begin + 1;
+  } else {
+    *begin = pack->entries.Begin();
+    *end   = pack->entries.End();
+  }
+  return true;
+}
+
+struct UnpackJob
+{
+  PackFile*        pack;
+  Span<PackEntry*> entries;
+  const char*      dst_dir;
+  SDL_AtomicInt    failed;
+};
+
+static void UnpackEntry(void* user, u32 idx, u32 worker)
+{
+  UnpackJob* job = (UnpackJob*)user;
+  if (SDL_GetAtomicInt(&job->failed)) {
+    return;
+  }
+
+  PackEntry* e = job->entries[idx];
+  char dst[GOS_MAX_PATH];
+  SDL_snprintf(dst, sizeof(dst), "%s/%s", job->dst_dir, e->name);
+  printf("Unpacking %s\n", e->name);
+
+  // Write straight out of the mapped lump when possible, otherwise stream it
+  // so large entries aren't held in memory
+  bool ok = false;
+  Span<const u8> view = job->pack->ViewEntry(e);
+  if (view.buf) {
+    ok = SDL_SaveFile(dst, view.buf, view.len);
+  } else {
+    SDL_IOStream* src = job->pack->OpenEntry(e);
+    SDL_IOStream* out = src ? SDL_IOFromFile(dst, "wb") : NULL;
+    ok = out && CopyIO(out, src, e->len);
+    if (out) {
+      ok &= SDL_CloseIO(out);
+    }
+    if (src) {
+      SDL_CloseIO(src);
+    }
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Error: %s\n", SDL_GetError());
+    SDL_SetAtomicInt(&job->failed, 1);
+  }
+}
+
 static u8 GuessFileTypeForConversion(File* f, Span<u8> data)
 {
   SDL_assert(data.len >= 4);
@@ -133,12 +215,33 @@ int main(int argc, const char* argv[])
     return EXIT_SUCCESS;
   }
 
+  G.jobs = 1;
+
   int nfiles = argc - 1;
   for (int i = 1; i < argc; ++i) {
     if (!SDL_strcasecmp(argv[i], "--1997")) {
       G.options |= OPT_1997;
       nfiles -= 1;
     }
+    else if (!SDL_strcasecmp(argv[i], "--jobs")) {
+      char* end = NULL;
+      long jobs = (i + 1 < argc) ? SDL_strtol(argv[i + 1], &end, 10) : -1;
+      if (jobs < 0 || !end || *end) {
+        fprintf(stderr, "Error: --jobs needs a thread count. See ftconv --help\n");
+        return EXIT_FAILURE;
+      }
+      G.jobs = (u32)jobs;
+      nfiles -= 2;
+      ++i;
+    }
+    else if (!SDL_strcasecmp(argv[i], "--compact")) {
+      G.options |= OPT_COMPACT;
+      nfiles -= 1;
+    }
+    else if (!SDL_strcasecmp(argv[i], "--update")) {
+      G.options |= OPT_UPDATE;
+      nfiles -= 1;
+    }
     else if (!SDL_strcasecmp(argv[i], "--ls")) {
       G.options |= OPT_LS;
       nfiles -= 1;
@@ -166,6 +269,10 @@ int main(int argc, const char* argv[])
 
   int cur_file = 0;
   for (int i = 1; i < argc; ++i) {
+    if (!SDL_strcasecmp(argv[i], "--jobs")) {
+      ++i;
+      continue;
+    }
     if (argv[i][0] == '-') {
       continue;
     }
@@ -210,30 +317,124 @@ int main(int argc, const char* argv[])
         printf("%s:\n", f->path);
       }
       PackFile pack = { };
-      if (OpenPackFile(&pack, f->path)) {
-        for (PackEntry* e = pack.entries.Begin(); e != pack.entries.End(); ++e) {
-          if (f->subscript && !WildcardMatch(f->subscript, e->name)) {
-            continue;
-          }
-          printf("%s\n", e->name);
-        }
-        pack.Close();
-      } else {
+      if (!OpenPackFile(&pack, f->path)) {
+        fprintf(stderr, "Error: %s\n", SDL_GetError());
+        return EXIT_FAILURE;
+      }
+      defer { pack.Close(); };
+
+      PackEntry* begin = NULL;
+      PackEntry* end = NULL;
+      if (!SelectEntries(&pack, f->subscript, &begin, &end)) {
         fprintf(stderr, "Error: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
+      for (PackEntry* e = begin; e != end; ++e) {
+        if (f->subscript && IsWildcard(f->subscript) &&
+            !WildcardMatch(f->subscript, e->name)) {
+          continue;
+        }
+        printf("%s\n", e->name);
+      }
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // User wants to compact
+  if (G.files.len == 1 && G.first_file->is_archive && (G.options & OPT_COMPACT)) {
+    if (!CompactPackFile(G.first_file->path)) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
   }
 
   // User wants to pack
   if (G.files.len > 1 && G.last_file->is_archive) {
-    printf("OP: packing into %s\n", G.last_file->path);
-    if (G.last_file->subscript) {
-      printf("   as %s\n", G.last_file->subscript);
+    if (!(G.options & OPT_RAW)) {
+      fprintf(stderr, "Converting while packing is not yet implemented :(\n");
+      return EXIT_FAILURE;
     }
-    fprintf(stderr, "Not yet implemented :(\n");
-    return EXIT_FAILURE;
+
+    // Update an existing archive in place
+    if (G.last_file->subscript || (G.options & OPT_UPDATE)) {
+      if (G.last_file->subscript && IsWildcard(G.last_file->subscript)) {
+        fprintf(stderr, "Can't pack a file as %s, name a single entry\n",
+                G.last_file->subscript);
+        return EXIT_FAILURE;
+      }
+      if (G.last_file->subscript && G.files.len > 2) {
+        fprintf(stderr, "Only one file can be packed as %s\n", G.last_file->subscript);
+        return EXIT_FAILURE;
+      }
+
+      Span<PackUpdate> updates(MemAllocZ<PackUpdate>(G.files.len - 1), G.files.len - 1);
+      defer {
+        for (PackUpdate* u = updates.Begin(); u != updates.End(); ++u) {
+          if (u->src) {
+            SDL_CloseIO(u->src);
+          }
+        }
+        MemFree(updates.buf);
+      };
+
+      bool ok = true;
+      for (usize i = 0; i < updates.len && ok; ++i) {
+        File* f = &G.files[i];
+        PackUpdate* u = &updates[i];
+        u->name = G.last_file->subscript ? G.last_file->subscript : BaseName(f->path);
+        printf("Packing %s\n", u->name);
+
+        u->src = SDL_IOFromFile(f->path, "rb");
+        const Sint64 len = u->src ? SDL_GetIOSize(u->src) : -1;
+        u->len = (u64)len;
+        ok = len >= 0;
+      }
+
+      ok = ok && UpdatePackFile(G.last_file->path, updates);
+      if (ok && (G.options & OPT_COMPACT)) {
+        ok = CompactPackFile(G.last_file->path);
+      }
+      if (!ok) {
+        fprintf(stderr, "Error: %s\n", SDL_GetError());
+        return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+    }
+    if (!(G.options & OPT_YES) && SDL_GetPathInfo(G.last_file->path, NULL)) {
+      fprintf(stderr, "Error: %s already exists. Use --yes to overwrite it\n",
+              G.last_file->path);
+      return EXIT_FAILURE;
+    }
+
+    PackWriter writer = { };
+    if (!BeginPackFile(&writer, G.last_file->path)) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+
+    for (File* f = G.first_file; f != G.last_file; ++f) {
+      const char* name = BaseName(f->path);
+      printf("Packing %s\n", name);
+
+      SDL_IOStream* src = SDL_IOFromFile(f->path, "rb");
+      const Sint64 len = src ? SDL_GetIOSize(src) : -1;
+      bool ok = len >= 0 && writer.AddEntry(name, src, (u64)len);
+      if (src) {
+        SDL_CloseIO(src);
+      }
+      if (!ok) {
+        fprintf(stderr, "Error: %s\n", SDL_GetError());
+        writer.Abort();
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (!writer.Finish()) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
   }
 
   // User wants to unpack
@@ -256,26 +457,39 @@ int main(int argc, const char* argv[])
       fprintf(stderr, "Error: %s\n", SDL_GetError());
       return EXIT_FAILURE;
     }
+    defer { pack.Close(); };
 
-    for (PackEntry* e = pack.entries.Begin(); e != pack.entries.End(); ++e) {
-      if (pack_file->subscript && !WildcardMatch(pack_file->subscript, e->name)) {
+    PackEntry* begin = NULL;
+    PackEntry* end = NULL;
+    if (!SelectEntries(&pack, pack_file->subscript, &begin, &end)) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+
+    UnpackJob job = { };
+    job.pack    = &pack;
+    job.dst_dir = dst_dir;
+    job.entries = Span<PackEntry*>(MemAlloc<PackEntry*>(end - begin), 0);
+    defer { MemFree(job.entries.buf); };
+
+    for (PackEntry* e = begin; e != end; ++e) {
+      if (pack_file->subscript && IsWildcard(pack_file->subscript) &&
+          !WildcardMatch(pack_file->subscript, e->name)) {
         continue;
       }
-      char dst[GOS_MAX_PATH];
-      SDL_snprintf(dst, sizeof(dst), "%s/%s", dst_dir, e->name);
-      printf("Unpacking %s\n", e->name);
-
-      void* buf = pack.ReadEntry(e);
-      if (buf) {
-        if (!SDL_SaveFile(dst, buf, e->len)) {
-          fprintf(stderr, "Error: %s\n", SDL_GetError());
-          return EXIT_FAILURE;
-        }
-        MemFree(buf);
-      } else {
-        fprintf(stderr, "Error: %s\n", SDL_GetError());
-        return EXIT_FAILURE;
-      }
+      job.entries.buf[job.entries.len++] = e;
+    }
+
+    ThreadPool pool;
+    if (!CreateThreadPool(&pool, G.jobs)) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+    pool.ParallelFor(job.entries.len, UnpackEntry, &job);
+    pool.Destroy();
+
+    if (SDL_GetAtomicInt(&job.failed)) {
+      return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
@@ -296,10 +510,17 @@ int main(int argc, const char* argv[])
       return EXIT_FAILURE;
     }
 
+    ThreadPool pool;
+    if (!CreateThreadPool(&pool, G.jobs)) {
+      fprintf(stderr, "Error: %s\n", SDL_GetError());
+      return EXIT_FAILURE;
+    }
+    defer { pool.Destroy(); };
+
     switch (GuessFileTypeForConversion(&G.files[0], bytes)) {
     case FTYPE_BP2: {
       Bitmap bmp = { };
-      if (!LoadBP2(&bmp, io)) {
+      if (!LoadBP2(&bmp, io, &pool)) {
         fprintf(stderr, "Error decoding: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
@@ -311,7 +532,7 @@ int main(int argc, const char* argv[])
     } break;
     case FTYPE_BP3: {
       Bitmap bmp = { };
-      if (!LoadBP3(&bmp, io)) {
+      if (!LoadBP3(&bmp, io, &pool)) {
         fprintf(stderr, "Error decoding: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
@@ -322,24 +543,24 @@ int main(int argc, const char* argv[])
       return EXIT_SUCCESS;
     } break;
     case FTYPE_TXT_1997: {
-      char* text = DecodeTXT_1997(io);
-      if (!text) {
+      Span<char> text = DecodeTXT_1997(io);
+      if (!text.buf) {
         fprintf(stderr, "Error decoding: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
-      if (!SDL_SaveFile(G.files[1].path, text, SDL_strlen(text) + 1)) {
+      if (!SDL_SaveFile(G.files[1].path, text.buf, text.len + 1)) {
         fprintf(stderr, "Error writing: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
       return EXIT_SUCCESS;
     } break;
     case FTYPE_TXT_2006: {
-      char* text = DecodeTXT_2006(io);
-      if (!text) {
+      Span<char> text = DecodeTXT_2006(io, 0);
+      if (!text.buf) {
         fprintf(stderr, "Error decoding: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
-      if (!SDL_SaveFile(G.files[1].path, text, SDL_strlen(text) + 1)) {
+      if (!SDL_SaveFile(G.files[1].path, text.buf, text.len + 1)) {
         fprintf(stderr, "Error writing: %s\n", SDL_GetError());
         return EXIT_FAILURE;
       }
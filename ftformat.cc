@@ -87,123 +87,303 @@ struct BP2Params
   BMP_InfoHeader bih;
 };
 
-template <usize SRC_BPP, usize DST_BPP = SRC_BPP>
-static bool BP2_DecodeRLE(SDL_Surface* surf, SDL_IOStream* io, BP2Params* bp2)
+// Fill a repeat run of n pixels
+template <usize SRC_BPP, usize DST_BPP>
+static inline void BP2_FillRun(u8* dst, const u8* val, usize n)
 {
-  static_assert(DST_BPP >= SRC_BPP);
+  if constexpr (SRC_BPP == 1) {
+    // Every plane gets the same byte
+    SDL_memset(dst, val[0], n * DST_BPP);
+  } else {
+    if (n == 0) {
+      return;
+    }
+    SDL_memcpy(dst, val, DST_BPP);
+    // Keep doubling the filled part
+    for (usize filled = 1; filled < n; ) {
+      const usize count = Min(filled, n - filled);
+      SDL_memcpy(dst + filled * DST_BPP, dst, count * DST_BPP);
+      filled += count;
+    }
+  }
+}
 
-  const usize dst_pitch = Align4(bp2->bih.biWidth * DST_BPP);
-  u8* slice = MemAlloc<u8>(dst_pitch * 8);
-  defer { MemFree(slice); };
+// Copy a literal run of n pixels
+template <usize SRC_BPP, usize DST_BPP>
+static inline void BP2_CopyRun(u8* dst, const u8* src, usize n)
+{
+  if constexpr (SRC_BPP == DST_BPP) {
+    SDL_memcpy(dst, src, n * DST_BPP);
+  } else {
+    for (usize k = 0; k < n; ++k) {
+      for (usize plane = 0; plane < DST_BPP; ++plane) {
+        dst[k * DST_BPP + plane] = src[k * SRC_BPP + plane % SRC_BPP];
+      }
+    }
+  }
+}
 
-  for (u32 i = 0; i < bp2->bp2.slice_count; ++i) {
-    u32 chunk_len = 0;
-    if (!SDL_ReadU32LE(io, &chunk_len)) {
-      return false;
+// Expand one slice's runs into npixels column-major pixels, where every run
+// is contiguous. Runs past the end of the slice are cut off
+template <usize SRC_BPP, usize DST_BPP>
+static bool BP2_DecodeRuns(u8* dst, usize npixels, const u8* p, usize len)
+{
+  usize k = 0;
+  while (k < npixels) {
+    if (len < 2) {
+      return SDL_SetError("Malformed slice");
     }
-    u8* chunk = MemAlloc<u8>(chunk_len);
-    defer { MemFree(chunk); };
-    if (SDL_ReadIO(io, chunk, chunk_len) != chunk_len) {
-      return false;
+    const u16 ctrl = p[0] | (((u16)p[1]) << 8);
+    p += 2;
+    len -= 2;
+
+    const usize n = Min<usize>(ctrl & 0x7FFF, npixels - k);
+    if (ctrl & 0x8000) {
+      // repeat pixel
+      if (len < SRC_BPP) {
+        return SDL_SetError("Malformed slice");
+      }
+      BP2_FillRun<SRC_BPP, DST_BPP>(dst + k * DST_BPP, p, n);
+      p += SRC_BPP;
+      len -= SRC_BPP;
+    } else {
+      // literals
+      if (len < n * SRC_BPP) {
+        return SDL_SetError("Malformed slice");
+      }
+      BP2_CopyRun<SRC_BPP, DST_BPP>(dst + k * DST_BPP, p, n);
+      p += n * SRC_BPP;
+      len -= n * SRC_BPP;
     }
+    k += n;
+  }
+  return true;
+}
 
-    // Run-length decoding
-    bool rrle = false;
-    u32  rlen = 0;
-    u8   rval[SRC_BPP] = { };
-
-    u8* p = chunk;
-    for (u32 x = 0; x < bp2->bih.biWidth; ++x) {
-      u8* col = slice + x * DST_BPP;
-      for (u32 y = 0; y < 8; ++y) {
-        while (rlen == 0) {
-          if (chunk_len < 2) {
-            return SDL_SetError("Malformed slice");
-          }
-          const u16 ctrl = p[0] | (((u16)p[1]) << 8);
-          p += 2;
-          chunk_len -= 2;
-          if (ctrl & 0x8000) {
-            // repeat pixel
-            if (chunk_len < SRC_BPP) {
-              return SDL_SetError("Malformed slice");
-            }
-            for (usize plane = 0; plane < SRC_BPP; ++plane) {
-              rval[plane] = *p;
-              ++p;
-            }
-            chunk_len -= SRC_BPP;
-            rlen = ctrl & 0x7FFF;
-            rrle = true;
-          } else {
-            // read literals
-            rlen = ctrl;
-            rrle = false;
-          }
-        }
-        if (rrle) {
-          for (usize plane = 0; plane < DST_BPP; ++plane) {
-            col[plane] = rval[plane % SRC_BPP];
-          }
-        } else {
-          if (chunk_len < SRC_BPP) {
-            return SDL_SetError("Malformed slice");
-          }
-          u8 literal[SRC_BPP];
-          for (usize plane = 0; plane < SRC_BPP; ++plane) {
-            literal[plane] = *p;
-            ++p;
-          }
-          chunk_len -= SRC_BPP;
-          for (usize plane = 0; plane < DST_BPP; ++plane) {
-            col[plane] = literal[plane % SRC_BPP];
-          }
+struct BP2Slice
+{
+  const u8* data;
+  u32       len;
+};
+
+#ifdef SDL_SSE2_INTRINSICS
+
+// Transpose 16 columns of 8 bytes into 8 rows of 16 bytes
+SDL_TARGETING("sse2")
+static void BP2_Transpose16x8_SSE2(u8* const* rows, const u8* columns)
+{
+  __m128i a[8], b[8];
+  for (u32 k = 0; k < 8; ++k) {
+    const __m128i c0 = _mm_loadl_epi64((const __m128i*)(columns + 16 * k));
+    const __m128i c1 = _mm_loadl_epi64((const __m128i*)(columns + 16 * k + 8));
+    a[k] = _mm_unpacklo_epi8(c0, c1);  // Pairs of columns, by row
+  }
+  for (u32 k = 0; k < 4; ++k) {
+    b[2 * k]     = _mm_unpacklo_epi16(a[2 * k], a[2 * k + 1]); // 4 columns, rows 0-3
+    b[2 * k + 1] = _mm_unpackhi_epi16(a[2 * k], a[2 * k + 1]); // 4 columns, rows 4-7
+  }
+  for (u32 k = 0; k < 2; ++k) {
+    a[4 * k]     = _mm_unpacklo_epi32(b[4 * k],     b[4 * k + 2]); // 8 columns, rows 0-1
+    a[4 * k + 1] = _mm_unpackhi_epi32(b[4 * k],     b[4 * k + 2]); // rows 2-3
+    a[4 * k + 2] = _mm_unpacklo_epi32(b[4 * k + 1], b[4 * k + 3]); // rows 4-5
+    a[4 * k + 3] = _mm_unpackhi_epi32(b[4 * k + 1], b[4 * k + 3]); // rows 6-7
+  }
+  for (u32 k = 0; k < 4; ++k) {
+    _mm_storeu_si128((__m128i*)rows[2 * k],     _mm_unpacklo_epi64(a[k], a[k + 4]));
+    _mm_storeu_si128((__m128i*)rows[2 * k + 1], _mm_unpackhi_epi64(a[k], a[k + 4]));
+  }
+}
+
+#endif // SDL_SSE2_INTRINSICS
+
+// Transpose a decoded slice from column-major order into its 8 rows. Works
+// on blocks of 8 columns so reads stay within a few cache lines
+template <usize BPP>
+static void BP2_TransposeSlice(u8* const* rows, const u8* columns, u32 width)
+{
+  u32 x = 0;
+#ifdef SDL_SSE2_INTRINSICS
+  static const bool has_sse2 = SDL_HasSSE2();
+  if (BPP == 1 && has_sse2) {
+    for (; x + 16 <= width; x += 16) {
+      u8* const block_rows[8] = {
+        rows[0] + x, rows[1] + x, rows[2] + x, rows[3] + x,
+        rows[4] + x, rows[5] + x, rows[6] + x, rows[7] + x,
+      };
+      BP2_Transpose16x8_SSE2(block_rows, columns + x * 8);
+    }
+  }
+#endif
+  for (; x < width; x += 8) {
+    const u32 n = Min<u32>(8, width - x);
+    for (u32 y = 0; y < 8; ++y) {
+      u8* dst = rows[y] + x * BPP;
+      const u8* src = columns + (x * 8 + y) * BPP;
+      for (u32 k = 0; k < n; ++k) {
+        for (usize plane = 0; plane < BPP; ++plane) {
+          dst[k * BPP + plane] = src[k * 8 * BPP + plane];
         }
-        --rlen;
-        col += dst_pitch;
       }
     }
-    for (u32 y = 0; y < 8; ++y) {
-      u8* rsrc = slice + dst_pitch * y;
-      u8* rdst = (u8*)surf->pixels + surf->pitch * (y + i * 8);
-      SDL_memcpy(rdst, rsrc, bp2->bih.biWidth * DST_BPP);
+  }
+}
+
+struct BP2Job
+{
+  SDL_Surface*     surf;
+  const BP2Params* bp2;
+  const BP2Slice*  slices;
+  SDL_AtomicInt    failed;
+};
+
+// Decode slice i into its 8 surface rows. Slices are independent, so they
+// can be decoded in any order
+template <usize SRC_BPP, usize DST_BPP>
+static void BP2_DecodeSlice(void* user, u32 i, u32 worker)
+{
+  BP2Job* job = (BP2Job*)user;
+  const u32 width = job->bp2->bih.biWidth;
+
+  // Slices are stored column by column
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  defer { scratch->Reset(mark); };
+  u8* columns = scratch->Push<u8>((usize)width * 8 * DST_BPP);
+
+  const BP2Slice* s = &job->slices[i];
+  if (!BP2_DecodeRuns<SRC_BPP, DST_BPP>(columns, (usize)width * 8, s->data, s->len)) {
+    SDL_SetAtomicInt(&job->failed, 1);
+    return;
+  }
+
+  // Rows are stored bottom-up
+  const u32 height = job->bp2->bih.biHeight;
+  u8* rows[8];
+  for (u32 y = 0; y < 8; ++y) {
+    rows[y] = (u8*)job->surf->pixels + job->surf->pitch * (height - 1 - (y + i * 8));
+  }
+  BP2_TransposeSlice<DST_BPP>(rows, columns, width);
+}
+
+template <usize SRC_BPP, usize DST_BPP = SRC_BPP>
+static bool BP2_DecodeRLE(SDL_Surface* surf, SDL_IOStream* io, BP2Params* bp2, ThreadPool* pool,
+                          Arena* arena)
+{
+  static_assert(DST_BPP >= SRC_BPP);
+
+  const u32   width       = bp2->bih.biWidth;
+  const u32   slice_count = bp2->bp2.slice_count;
+  const usize dst_pitch   = Align4(width * DST_BPP);
+
+  if (slice_count > bp2->bih.biHeight / 8) {
+    return SDL_SetError("Malformed image");
+  }
+
+  // Memory streams are decoded in place. Anything else has each section read
+  // onto the arena as it comes, so only the image itself is read. Section
+  // lengths are checked against the rest of the stream, or against max_len
+  // when its size isn't known, before anything is pushed for them
+  const Sint64 start = SDL_TellIO(io);
+  const Span<const u8> view = ViewIO(io);
+  ByteReader rd(view);
+  Sint64 remaining = -1;
+  if (!view.buf) {
+    const Sint64 size = SDL_GetIOSize(io);
+    if (size >= 0 && start >= 0) {
+      remaining = Max<Sint64>(size - start, 0);
+    }
+  }
+  auto take_section = [&](u32* len, usize max_len) -> const u8* {
+    if (view.buf) {
+      return rd.ReadU32LE(len) ? rd.Take(*len) : NULL;
+    }
+    if (!SDL_ReadU32LE(io, len)) {
+      return NULL;
+    }
+    if (remaining >= 0) {
+      if ((Sint64)*len > remaining - 4) {
+        SDL_SetError("Unexpected end of data");
+        return NULL;
+      }
+      remaining -= 4 + (Sint64)*len;
+    } else if (*len > max_len) {
+      SDL_SetError("Malformed section");
+      return NULL;
+    }
+    u8* buf = arena->Push<u8>(*len);
+    if (SDL_ReadIO(io, buf, *len) != *len) {
+      return NULL;
+    }
+    return buf;
+  };
+
+  // Gather every slice up front so they can be decoded independently. At
+  // worst every pixel is its own literal run
+  BP2Slice* slices = arena->Push<BP2Slice>(slice_count);
+  const usize max_slice_len = (usize)width * 8 * (2 + SRC_BPP);
+
+  for (u32 i = 0; i < slice_count; ++i) {
+    if (!(slices[i].data = take_section(&slices[i].len, max_slice_len))) {
+      return false;
+    }
+  }
+
+  BP2Job job = { };
+  job.surf   = surf;
+  job.bp2    = bp2;
+  job.slices = slices;
+
+  if (pool) {
+    pool->ParallelFor(slice_count, BP2_DecodeSlice<SRC_BPP, DST_BPP>, &job);
+  } else {
+    for (u32 i = 0; i < slice_count; ++i) {
+      BP2_DecodeSlice<SRC_BPP, DST_BPP>(&job, i, 0);
     }
   }
 
+  // Errors are per thread, so report it here
+  if (SDL_GetAtomicInt(&job.failed)) {
+    return SDL_SetError("Malformed slice");
+  }
+
   if (bp2->bih.biHeight % 8 != 0) {
     if ((bp2->bih.biHeight % 8) * dst_pitch != bp2->bp2.extra_slice_count) {
       return SDL_SetError("Malformed trailing data");;
     }
     u32 extra_bytes = 0;
-    if (!SDL_ReadU32LE(io, &extra_bytes)) {
-      return false;
-    }
-
-    if (SDL_ReadIO(io, slice, extra_bytes) != extra_bytes) {
+    const u8* slice = take_section(&extra_bytes, bp2->bp2.extra_slice_count);
+    if (!slice) {
       return false;
     }
     if (extra_bytes != bp2->bp2.extra_slice_count) {
       return false;
     }
+    // Uncompressed tail rows, at the top of the image
     u32 extra = bp2->bih.biHeight % 8;
     for (u32 y = 0; y < extra; ++y) {
-      u8* src_row = slice + dst_pitch * y;
-      u8* dst_row = (u8*)surf->pixels + surf->pitch * (bp2->bih.biHeight - extra + y);
+      const u8* src_row = slice + dst_pitch * y;
+      u8* dst_row = (u8*)surf->pixels + surf->pitch * (extra - 1 - y);
       SDL_memcpy(dst_row, src_row, bp2->bih.biWidth * DST_BPP);
     }
   }
 
-  if (!SDL_FlipSurface(surf, SDL_FLIP_VERTICAL)) {
+  if (view.buf && SDL_SeekIO(io, start + (rd.pos - view.buf), SDL_IO_SEEK_SET) < 0) {
     return false;
   }
 
   return true;
 }
 
-bool LoadBP2(Bitmap* bmp, SDL_IOStream* src)
+bool LoadBP2(Bitmap* bmp, SDL_IOStream* src, ThreadPool* pool, Arena* arena)
 {
   BP2Params bpar = { };
 
+  if (!arena) {
+    arena = GetScratchArena();
+  }
+  const ArenaMark mark = arena->Mark();
+  defer { arena->Reset(mark); };
+
   bool ok =
     SDL_ReadU32LE(src, &bpar.bp2.magic) &&
     SDL_ReadU32LE(src, &bpar.bp2.encoding) &&
@@ -233,15 +413,13 @@ bool LoadBP2(Bitmap* bmp, SDL_IOStream* src)
     u32 ncolors = bpar.bp2.palette_len / 4;
 
     usize len = bpar.bp2.palette_len;
-    u8* palette = MemAlloc<u8>(bpar.bp2.palette_len);
+    u8* palette = arena->Push<u8>(bpar.bp2.palette_len);
     if (SDL_ReadIO(src, palette, len) != len) {
       return false;
     }
-    defer { MemFree(palette); };
 
     // Convert palette bytes to SDL_Colors
-    SDL_Color* colors = MemAlloc<SDL_Color>(ncolors);
-    defer { MemFree(colors); };
+    SDL_Color* colors = arena->Push<SDL_Color>(ncolors);
 
     for (u32 i = 0; i < ncolors; ++i) {
       colors[i].r = palette[i * 4 + 2];
@@ -277,14 +455,14 @@ bool LoadBP2(Bitmap* bmp, SDL_IOStream* src)
 
   switch (bpar.bp2.encoding) {
   case BP2_FMT_INDEX8: {
-    ok &= BP2_DecodeRLE<1>(bmp->surf, src, &bpar);
+    ok &= BP2_DecodeRLE<1>(bmp->surf, src, &bpar, pool, arena);
     ok &= SDL_SetSurfacePalette(bmp->surf, bmp->pal);
   } break;
   case BP2_FMT_BGR888: {
-    ok &= BP2_DecodeRLE<3>(bmp->surf, src, &bpar);
+    ok &= BP2_DecodeRLE<3>(bmp->surf, src, &bpar, pool, arena);
   } break;
   case BP2_FMT_GRAY8: {
-    ok &= BP2_DecodeRLE<1, 3>(bmp->surf, src, &bpar);
+    ok &= BP2_DecodeRLE<1, 3>(bmp->surf, src, &bpar, pool, arena);
   } break;
   default: {
     ok &= SDL_SetError("Invalid encoding method: %d", bpar.bp2.encoding);
@@ -332,9 +510,355 @@ struct BP3Params
   BMP_InfoHeader bih;
 };
 
-bool LoadBP3(Bitmap* bmp, SDL_IOStream* io)
+// Bits per pixel of each tile mode
+static const u32 BP3_MODE_BPP[] = { 0, 8, 8, 8, 4, 8, 16, 24 };
+
+// One decoded 8x8 tile, stored as a plane per channel
+struct BP3Tile
+{
+  u8 b[64];
+  u8 g[64];
+  u8 r[64];
+};
+
+// Decode a tile from its packed pixels, zero-padded to a full 8x8 tile.
+// base is the tile's BGR entry in the parameter table
+typedef void (*BP3TileKernel)(BP3Tile* tile, const u8* src, const u8* base);
+
+//
+// Scalar kernels (reference)
+//
+
+static void BP3_DecodeSolid(BP3Tile* tile, const u8* src, const u8* base)
+{
+  SDL_memset(tile->b, base[0], 64);
+  SDL_memset(tile->g, base[1], 64);
+  SDL_memset(tile->r, base[2], 64);
+}
+
+// BGR332, BGR233 and BGR323 only differ in their field layout
+template <u32 B_SHIFT, u32 B_MASK, u32 G_SHIFT, u32 G_MASK, u32 R_SHIFT, u32 R_MASK>
+static void BP3_DecodePacked8(BP3Tile* tile, const u8* src, const u8* base)
+{
+  for (u32 k = 0; k < 64; ++k) {
+    const u8 p = src[k];
+    tile->b[k] = (u8)(((p >> B_SHIFT) & B_MASK) + base[0]);
+    tile->g[k] = (u8)(((p >> G_SHIFT) & G_MASK) + base[1]);
+    tile->r[k] = (u8)(((p >> R_SHIFT) & R_MASK) + base[2]);
+  }
+}
+
+#define BP3_DecodeBGR332 BP3_DecodePacked8<0, 7, 3, 7, 6, 3>
+#define BP3_DecodeBGR233 BP3_DecodePacked8<0, 3, 2, 7, 5, 7>
+#define BP3_DecodeBGR323 BP3_DecodePacked8<0, 7, 3, 3, 5, 7>
+
+static void BP3_DecodeGray4(BP3Tile* tile, const u8* src, const u8* base)
+{
+  for (u32 k = 0; k < 64; ++k) {
+    const u8 p = src[k / 2];
+    const u8 nib = (k & 1) ? (u8)(p >> 4) : (u8)(p & 0x0F);
+    tile->b[k] = (u8)(nib + base[0]);
+    tile->g[k] = (u8)(nib + base[1]);
+    tile->r[k] = (u8)(nib + base[2]);
+  }
+}
+
+static void BP3_DecodeGray8(BP3Tile* tile, const u8* src, const u8* base)
+{
+  SDL_memcpy(tile->b, src, 64);
+  SDL_memcpy(tile->g, src, 64);
+  SDL_memcpy(tile->r, src, 64);
+}
+
+static void BP3_DecodeBGR555(BP3Tile* tile, const u8* src, const u8* base)
+{
+  for (u32 k = 0; k < 64; ++k) {
+    const u16 p = src[2 * k] | (src[2 * k + 1] << 8);
+    tile->b[k] = (u8)(((p >> 0) & 0x1F) + base[0]);
+    tile->g[k] = (u8)(((p >> 5) & 0x1F) + base[1]);
+    tile->r[k] = (u8)(((p >> 10) & 0x1F) + base[2]);
+  }
+}
+
+static void BP3_DecodeBGR888(BP3Tile* tile, const u8* src, const u8* base)
+{
+  for (u32 k = 0; k < 64; ++k) {
+    tile->b[k] = src[3 * k + 0];
+    tile->g[k] = src[3 * k + 1];
+    tile->r[k] = src[3 * k + 2];
+  }
+}
+
+static const BP3TileKernel BP3_KERNELS_SCALAR[] = {
+  BP3_DecodeSolid,
+  BP3_DecodeBGR332,
+  BP3_DecodeBGR233,
+  BP3_DecodeBGR323,
+  BP3_DecodeGray4,
+  BP3_DecodeGray8,
+  BP3_DecodeBGR555,
+  BP3_DecodeBGR888,
+};
+
+//
+// SSE2 kernels
+//
+
+#ifdef SDL_SSE2_INTRINSICS
+
+// x86 has no 8-bit shifts. Shifting 16-bit lanes is fine as long as the mask
+// drops the bits pulled in from the neighbouring byte
+#define BP3_SSE2_FIELD(p, shift, mask) \
+  _mm_and_si128(_mm_srli_epi16((p), (shift)), _mm_set1_epi8((char)(mask)))
+
+template <u32 B_SHIFT, u32 B_MASK, u32 G_SHIFT, u32 G_MASK, u32 R_SHIFT, u32 R_MASK>
+SDL_TARGETING("sse2")
+static void BP3_DecodePacked8_SSE2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m128i bb = _mm_set1_epi8((char)base[0]);
+  const __m128i bg = _mm_set1_epi8((char)base[1]);
+  const __m128i br = _mm_set1_epi8((char)base[2]);
+  for (u32 k = 0; k < 64; k += 16) {
+    const __m128i p = _mm_loadu_si128((const __m128i*)(src + k));
+    _mm_storeu_si128((__m128i*)(tile->b + k),
+                     _mm_add_epi8(BP3_SSE2_FIELD(p, B_SHIFT, B_MASK), bb));
+    _mm_storeu_si128((__m128i*)(tile->g + k),
+                     _mm_add_epi8(BP3_SSE2_FIELD(p, G_SHIFT, G_MASK), bg));
+    _mm_storeu_si128((__m128i*)(tile->r + k),
+                     _mm_add_epi8(BP3_SSE2_FIELD(p, R_SHIFT, R_MASK), br));
+  }
+}
+
+SDL_TARGETING("sse2")
+static void BP3_DecodeGray4_SSE2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m128i bb = _mm_set1_epi8((char)base[0]);
+  const __m128i bg = _mm_set1_epi8((char)base[1]);
+  const __m128i br = _mm_set1_epi8((char)base[2]);
+  for (u32 k = 0; k < 64; k += 32) {
+    const __m128i p  = _mm_loadu_si128((const __m128i*)(src + k / 2));
+    const __m128i lo = BP3_SSE2_FIELD(p, 0, 0x0F);
+    const __m128i hi = BP3_SSE2_FIELD(p, 4, 0x0F);
+    // Low nibble is the left pixel
+    const __m128i n0 = _mm_unpacklo_epi8(lo, hi);
+    const __m128i n1 = _mm_unpackhi_epi8(lo, hi);
+    _mm_storeu_si128((__m128i*)(tile->b + k),      _mm_add_epi8(n0, bb));
+    _mm_storeu_si128((__m128i*)(tile->b + k + 16), _mm_add_epi8(n1, bb));
+    _mm_storeu_si128((__m128i*)(tile->g + k),      _mm_add_epi8(n0, bg));
+    _mm_storeu_si128((__m128i*)(tile->g + k + 16), _mm_add_epi8(n1, bg));
+    _mm_storeu_si128((__m128i*)(tile->r + k),      _mm_add_epi8(n0, br));
+    _mm_storeu_si128((__m128i*)(tile->r + k + 16), _mm_add_epi8(n1, br));
+  }
+}
+
+SDL_TARGETING("sse2")
+static void BP3_DecodeBGR555_SSE2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m128i bb   = _mm_set1_epi8((char)base[0]);
+  const __m128i bg   = _mm_set1_epi8((char)base[1]);
+  const __m128i br   = _mm_set1_epi8((char)base[2]);
+  const __m128i mask = _mm_set1_epi16(0x1F);
+  for (u32 k = 0; k < 64; k += 16) {
+    const __m128i p0 = _mm_loadu_si128((const __m128i*)(src + 2 * k));
+    const __m128i p1 = _mm_loadu_si128((const __m128i*)(src + 2 * k + 16));
+    // Fields are at most 31, so packing to bytes never saturates
+    const __m128i b = _mm_packus_epi16(_mm_and_si128(p0, mask),
+                                       _mm_and_si128(p1, mask));
+    const __m128i g = _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(p0, 5), mask),
+                                       _mm_and_si128(_mm_srli_epi16(p1, 5), mask));
+    const __m128i r = _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(p0, 10), mask),
+                                       _mm_and_si128(_mm_srli_epi16(p1, 10), mask));
+    _mm_storeu_si128((__m128i*)(tile->b + k), _mm_add_epi8(b, bb));
+    _mm_storeu_si128((__m128i*)(tile->g + k), _mm_add_epi8(g, bg));
+    _mm_storeu_si128((__m128i*)(tile->r + k), _mm_add_epi8(r, br));
+  }
+}
+
+static const BP3TileKernel BP3_KERNELS_SSE2[] = {
+  BP3_DecodeSolid,
+  BP3_DecodePacked8_SSE2<0, 7, 3, 7, 6, 3>,
+  BP3_DecodePacked8_SSE2<0, 3, 2, 7, 5, 7>,
+  BP3_DecodePacked8_SSE2<0, 7, 3, 3, 5, 7>,
+  BP3_DecodeGray4_SSE2,
+  BP3_DecodeGray8,
+  BP3_DecodeBGR555_SSE2,
+  BP3_DecodeBGR888, // Deinterleaving 3-byte pixels needs pshufb
+};
+
+#endif // SDL_SSE2_INTRINSICS
+
+//
+// AVX2 kernels
+//
+
+#ifdef SDL_AVX2_INTRINSICS
+
+#define BP3_AVX2_FIELD(p, shift, mask) \
+  _mm256_and_si256(_mm256_srli_epi16((p), (shift)), _mm256_set1_epi8((char)(mask)))
+
+template <u32 B_SHIFT, u32 B_MASK, u32 G_SHIFT, u32 G_MASK, u32 R_SHIFT, u32 R_MASK>
+SDL_TARGETING("avx2")
+static void BP3_DecodePacked8_AVX2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m256i bb = _mm256_set1_epi8((char)base[0]);
+  const __m256i bg = _mm256_set1_epi8((char)base[1]);
+  const __m256i br = _mm256_set1_epi8((char)base[2]);
+  for (u32 k = 0; k < 64; k += 32) {
+    const __m256i p = _mm256_loadu_si256((const __m256i*)(src + k));
+    _mm256_storeu_si256((__m256i*)(tile->b + k),
+                        _mm256_add_epi8(BP3_AVX2_FIELD(p, B_SHIFT, B_MASK), bb));
+    _mm256_storeu_si256((__m256i*)(tile->g + k),
+                        _mm256_add_epi8(BP3_AVX2_FIELD(p, G_SHIFT, G_MASK), bg));
+    _mm256_storeu_si256((__m256i*)(tile->r + k),
+                        _mm256_add_epi8(BP3_AVX2_FIELD(p, R_SHIFT, R_MASK), br));
+  }
+}
+
+SDL_TARGETING("avx2")
+static void BP3_DecodeGray4_AVX2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m256i p  = _mm256_loadu_si256((const __m256i*)src);
+  const __m256i lo = BP3_AVX2_FIELD(p, 0, 0x0F);
+  const __m256i hi = BP3_AVX2_FIELD(p, 4, 0x0F);
+  // Unpacking works per 128-bit lane, giving pixels [0, 16) + [32, 48) and
+  // [16, 32) + [48, 64). Swap the middle halves back into order
+  const __m256i u0 = _mm256_unpacklo_epi8(lo, hi);
+  const __m256i u1 = _mm256_unpackhi_epi8(lo, hi);
+  const __m256i n0 = _mm256_permute2x128_si256(u0, u1, 0x20);
+  const __m256i n1 = _mm256_permute2x128_si256(u0, u1, 0x31);
+
+  const __m256i bb = _mm256_set1_epi8((char)base[0]);
+  const __m256i bg = _mm256_set1_epi8((char)base[1]);
+  const __m256i br = _mm256_set1_epi8((char)base[2]);
+  _mm256_storeu_si256((__m256i*)(tile->b),      _mm256_add_epi8(n0, bb));
+  _mm256_storeu_si256((__m256i*)(tile->b + 32), _mm256_add_epi8(n1, bb));
+  _mm256_storeu_si256((__m256i*)(tile->g),      _mm256_add_epi8(n0, bg));
+  _mm256_storeu_si256((__m256i*)(tile->g + 32), _mm256_add_epi8(n1, bg));
+  _mm256_storeu_si256((__m256i*)(tile->r),      _mm256_add_epi8(n0, br));
+  _mm256_storeu_si256((__m256i*)(tile->r + 32), _mm256_add_epi8(n1, br));
+}
+
+SDL_TARGETING("avx2")
+static void BP3_DecodeBGR555_AVX2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  const __m256i bb   = _mm256_set1_epi8((char)base[0]);
+  const __m256i bg   = _mm256_set1_epi8((char)base[1]);
+  const __m256i br   = _mm256_set1_epi8((char)base[2]);
+  const __m256i mask = _mm256_set1_epi16(0x1F);
+  for (u32 k = 0; k < 64; k += 32) {
+    const __m256i p0 = _mm256_loadu_si256((const __m256i*)(src + 2 * k));
+    const __m256i p1 = _mm256_loadu_si256((const __m256i*)(src + 2 * k + 32));
+    // Packing is per lane too, permute 64-bit blocks back into pixel order
+    const __m256i b = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(p0, mask),
+                          _mm256_and_si256(p1, mask)), 0xD8);
+    const __m256i g = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(_mm256_srli_epi16(p0, 5), mask),
+                          _mm256_and_si256(_mm256_srli_epi16(p1, 5), mask)), 0xD8);
+    const __m256i r = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(_mm256_srli_epi16(p0, 10), mask),
+                          _mm256_and_si256(_mm256_srli_epi16(p1, 10), mask)), 0xD8);
+    _mm256_storeu_si256((__m256i*)(tile->b + k), _mm256_add_epi8(b, bb));
+    _mm256_storeu_si256((__m256i*)(tile->g + k), _mm256_add_epi8(g, bg));
+    _mm256_storeu_si256((__m256i*)(tile->r + k), _mm256_add_epi8(r, br));
+  }
+}
+
+SDL_TARGETING("avx2")
+static void BP3_DecodeBGR888_AVX2(BP3Tile* tile, const u8* src, const u8* base)
+{
+  // pshufb masks gathering one channel of 16 pixels from three 16-byte loads
+  const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+  for (u32 k = 0; k < 64; k += 16) {
+    const __m128i p0 = _mm_loadu_si128((const __m128i*)(src + 3 * k));
+    const __m128i p1 = _mm_loadu_si128((const __m128i*)(src + 3 * k + 16));
+    const __m128i p2 = _mm_loadu_si128((const __m128i*)(src + 3 * k + 32));
+    _mm_storeu_si128((__m128i*)(tile->b + k),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, b0),
+                                               _mm_shuffle_epi8(p1, b1)),
+                                  _mm_shuffle_epi8(p2, b2)));
+    _mm_storeu_si128((__m128i*)(tile->g + k),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, g0),
+                                               _mm_shuffle_epi8(p1, g1)),
+                                  _mm_shuffle_epi8(p2, g2)));
+    _mm_storeu_si128((__m128i*)(tile->r + k),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, r0),
+                                               _mm_shuffle_epi8(p1, r1)),
+                                  _mm_shuffle_epi8(p2, r2)));
+  }
+}
+
+static const BP3TileKernel BP3_KERNELS_AVX2[] = {
+  BP3_DecodeSolid,
+  BP3_DecodePacked8_AVX2<0, 7, 3, 7, 6, 3>,
+  BP3_DecodePacked8_AVX2<0, 3, 2, 7, 5, 7>,
+  BP3_DecodePacked8_AVX2<0, 7, 3, 3, 5, 7>,
+  BP3_DecodeGray4_AVX2,
+  BP3_DecodeGray8,
+  BP3_DecodeBGR555_AVX2,
+  BP3_DecodeBGR888_AVX2,
+};
+
+#endif // SDL_AVX2_INTRINSICS
+
+// Pick the best kernels for this CPU, once
+static const BP3TileKernel* BP3_GetKernels()
+{
+  static const BP3TileKernel* kernels = []() {
+#ifdef SDL_AVX2_INTRINSICS
+    if (SDL_HasAVX2()) {
+      return BP3_KERNELS_AVX2;
+    }
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    if (SDL_HasSSE2()) {
+      return BP3_KERNELS_SSE2;
+    }
+#endif
+    return BP3_KERNELS_SCALAR;
+  }();
+  return kernels;
+}
+
+// Headers, tables and tile payload of a BP3 file, ready to decode
+struct BP3Image
+{
+  BP3Params bpar;
+  const u8* mode_tab;
+  const u8* param_tab;
+  usize*    tile_offs; // Payload offset of each tile
+  const u8* payload;
+
+  // Where the tile offsets and any data that couldn't be borrowed from the
+  // stream live, until BP3_FreeImage
+  Arena*    arena;
+  ArenaMark mark;
+};
+
+static void BP3_FreeImage(BP3Image* img)
+{
+  if (img->arena) {
+    img->arena->Reset(img->mark);
+  }
+  *img = { };
+}
+
+// Temporaries go on arena, or this thread's scratch arena if NULL
+static bool BP3_LoadImage(BP3Image* img, SDL_IOStream* io, Arena* arena)
 {
-  BP3Params bpar = { };
+  img->arena = arena ? arena : GetScratchArena();
+  img->mark  = img->arena->Mark();
+  arena = img->arena;
+
+  BP3Params& bpar = img->bpar;
   bool ok =
     SDL_ReadU32LE(io, &bpar.bp3.magic) &&
     SDL_ReadU32LE(io, &bpar.bp3.width) &&
@@ -358,30 +882,41 @@ bool LoadBP3(Bitmap* bmp, SDL_IOStream* io)
   const u32 padded_h      = Align8(bpar.bp3.height);
   const u32 num_tiles     = (padded_w * padded_h) / 64;
   const u32 tiles_per_row = padded_w / 8;
-  const u32 grid_row_bytes = 3 * padded_w;
 
-  u8* mode_tab = MemAlloc<u8>(num_tiles);
-  defer { MemFree(mode_tab); };
-  if (SDL_ReadIO(io, mode_tab, num_tiles) != num_tiles) {
-    return false;
-  }
+  // Memory streams are decoded in place. Anything else gets the tables and
+  // the tile payload read in one call each
+  ByteReader view = ViewIO(io);
+  const u8* view_start = view.pos;
+  const bool borrowed  = view.Remaining() > 0;
 
-  u8* param_tab = MemAlloc<u8>(num_tiles * 3);
-  defer { MemFree(param_tab); };
-  if (SDL_ReadIO(io, param_tab, num_tiles * 3) != num_tiles * 3) {
-    return false;
+  if (borrowed) {
+    img->mode_tab  = view.Take(num_tiles);
+    img->param_tab = view.Take(num_tiles * 3);
+    if (!img->mode_tab || !img->param_tab) {
+      return false;
+    }
+  } else {
+    u8* tabs = arena->Push<u8>(num_tiles * 4);
+    if (SDL_ReadIO(io, tabs, num_tiles * 4) != num_tiles * 4) {
+      return false;
+    }
+    img->mode_tab  = tabs;
+    img->param_tab = tabs + num_tiles;
   }
 
-  // full padded grid (BGR24)
-  u8* outbuf = MemAlloc<u8>(padded_w * padded_h * 3);
-  defer { MemFree(outbuf); };
-  SDL_memset(outbuf, 0, padded_w * padded_h * 3);
-
-  // scratch for one tile (max 24 bpp * 8 rows = 192 bytes)
-  u8 tile_buf[192];
+  // Prefix sum of the stored tile sizes gives every tile's payload offset.
+  // Only whole rows are read for a tile, so the payload may end a little
+  // short of the sum
+  usize* tile_offs = img->tile_offs = arena->Push<usize>(num_tiles + 1);
 
+  usize payload_need = 0;
+  tile_offs[0] = 0;
   for (u32 i = 0; i < num_tiles; ++i) {
-    // tile extents (handle right/bottom partial tiles)
+    if (img->mode_tab[i] >= ArrLen(BP3_MODE_BPP)) {
+      return SDL_SetError("Invalid tile mode");
+    }
+    const u32 bpp = BP3_MODE_BPP[img->mode_tab[i]];
+
     u32 chunk_w = 8;
     if ((i % tiles_per_row) * 8 + 8 >= (u32)bpar.bp3.width) {
       chunk_w = (u32)bpar.bp3.width + 8 - padded_w;
@@ -392,382 +927,1510 @@ bool LoadBP3(Bitmap* bmp, SDL_IOStream* io)
       chunk_h = (u32)bpar.bp3.height + 8 - padded_h;
     }
 
-    u32 bpp = 0;
-    switch (mode_tab[i]) {
-      case BP3_FMT_SOLID:  bpp = 0;  break;
-      case BP3_FMT_BGR332: bpp = 8;  break;
-      case BP3_FMT_BGR233: bpp = 8;  break;
-      case BP3_FMT_BGR323: bpp = 8;  break;
-      case BP3_FMT_GRAY4:  bpp = 4;  break;
-      case BP3_FMT_GRAY8:  bpp = 8;  break;
-      case BP3_FMT_BGR555: bpp = 16; break;
-      case BP3_FMT_BGR888: bpp = 24; break;
-      default: return SDL_SetError("Invalid tile mode");
-    }
-
-    SDL_memset(tile_buf, 0, sizeof(tile_buf));
-
-    // read this tile’s packed rows, pad each stored row to 'bpp' bytes, then pad to 8 rows
+    tile_offs[i + 1] = tile_offs[i] + bpp * chunk_w * chunk_h / 8;
     if (bpp > 0) {
-      const Sint64 pos0 = SDL_TellIO(io);
-      if (pos0 < 0) {
-        return false;
-      }
-
-      const u32 stored_row_bytes = (bpp * chunk_w) / 8;
-      const u32 pad_per_row      = bpp - stored_row_bytes;  // pad each row to 'bpp' bytes
-      u32 dst = 0;
-
-      for (u32 y = 0; y < chunk_h; ++y) {
-        if (stored_row_bytes) {
-          if (dst + stored_row_bytes > sizeof(tile_buf)) {
-            return SDL_SetError("Malformed tile data");
-          }
-          if (SDL_ReadIO(io, &tile_buf[dst], stored_row_bytes) != stored_row_bytes) {
-            return false;
-          }
-          dst += stored_row_bytes;
-        }
-        if (pad_per_row) {
-          if (dst + pad_per_row > sizeof(tile_buf)) {
-            return SDL_SetError("Malformed tile data");
-          }
-          SDL_memset(&tile_buf[dst], 0, pad_per_row);
-          dst += pad_per_row;
-        }
-      }
-
-      const u32 total_needed = bpp * 8;
-      if (total_needed > sizeof(tile_buf)) {
-        return SDL_SetError("Malformed tile data");
-      }
-      if (dst < total_needed) {
-        SDL_memset(&tile_buf[dst], 0, total_needed - dst);
-      }
-
-      // advance file by actual stored bytes for this tile (no per-row padding)
-      const u64 stored_total = (u64)bpp * (u64)chunk_w * (u64)chunk_h / 8;
-      if (SDL_SeekIO(io, pos0 + (Sint64)stored_total, SDL_IO_SEEK_SET) < 0) {
-        return false;
-      }
+      payload_need = tile_offs[i] + (bpp * chunk_w / 8) * chunk_h;
     }
+  }
 
-    // decode tile into outbuf
-    const u32 tile_row_base = grid_row_bytes * 8 * (i / tiles_per_row);
-    const u32 tile_col_base = 24 * (i % tiles_per_row);
-    const u32 src_step      = bpp / 8; // bytes per pixel for most modes
-
-    const u8 base_b = param_tab[3 * i + 0];
-    const u8 base_g = param_tab[3 * i + 1];
-    const u8 base_r = param_tab[3 * i + 2];
-
-    u32 src_row_byte_off = 0; // start of row in tile_buf (bpp bytes per row)
-
-    for (u32 ty = 0; ty < 8; ++ty) {
-      u32 dst_off = tile_col_base + tile_row_base + ty * grid_row_bytes;
-      u32 src_off = src_row_byte_off;
-
-      for (u32 tx = 0; tx < 8; ++tx) {
-        switch (mode_tab[i]) {
-          case BP3_FMT_SOLID: {
-            outbuf[dst_off + 0] = base_b;
-            outbuf[dst_off + 1] = base_g;
-            outbuf[dst_off + 2] = base_r;
-          } break;
-          case BP3_FMT_BGR332: {
-            const u8 p = tile_buf[src_off];
-            outbuf[dst_off + 0] = (((p >> 0) & 7) + base_b) & 0xFF;
-            outbuf[dst_off + 1] = (((p >> 3) & 7) + base_g) & 0xFF;
-            outbuf[dst_off + 2] = (((p >> 6) & 3) + base_r) & 0xFF;
-          } break;
-          case BP3_FMT_BGR233: {
-            const u8 p = tile_buf[src_off];
-            outbuf[dst_off + 0] = (((p >> 0) & 3) + base_b) & 0xFF;
-            outbuf[dst_off + 1] = (((p >> 2) & 7) + base_g) & 0xFF;
-            outbuf[dst_off + 2] = (((p >> 5) & 7) + base_r) & 0xFF;
-          } break;
-          case BP3_FMT_BGR323: {
-            const u8 p = tile_buf[src_off];
-            outbuf[dst_off + 0] = (((p >> 0) & 7) + base_b) & 0xFF;
-            outbuf[dst_off + 1] = (((p >> 3) & 3) + base_g) & 0xFF;
-            outbuf[dst_off + 2] = (((p >> 5) & 7) + base_r) & 0xFF;
-          } break;
-          case BP3_FMT_GRAY4: {
-            const u8 p = tile_buf[src_off];
-            const u8 nib = (tx & 1) ? (u8)((p >> 4) & 0x0F) : (u8)(p & 0x0F);
-            outbuf[dst_off + 0] = (nib + base_b) & 0xFF;
-            outbuf[dst_off + 1] = (nib + base_g) & 0xFF;
-            outbuf[dst_off + 2] = (nib + base_r) & 0xFF;
-          } break;
-          case BP3_FMT_GRAY8: {
-            const u8 p = tile_buf[src_off];
-            outbuf[dst_off + 0] = p;
-            outbuf[dst_off + 1] = p;
-            outbuf[dst_off + 2] = p;
-          } break;
-          case BP3_FMT_BGR555: {
-            const u8 p0 = tile_buf[src_off + 0];
-            const u8 p1 = tile_buf[src_off + 1];
-            outbuf[dst_off + 0] = (u8)(((p0) & 0x1F) + base_b);
-            outbuf[dst_off + 1] = (u8)((((p0 >> 5) + 8 * (p1 & 3)) + base_g));
-            outbuf[dst_off + 2] = (u8)(((p1 & 0x7C) >> 2) + base_r);
-          } break;
-          case BP3_FMT_BGR888: {
-            outbuf[dst_off + 0] = tile_buf[src_off + 0];
-            outbuf[dst_off + 1] = tile_buf[src_off + 1];
-            outbuf[dst_off + 2] = tile_buf[src_off + 2];
-          } break;
-        }
+  const usize payload_len = tile_offs[num_tiles];
+  if (borrowed) {
+    if (view.Remaining() < payload_need) {
+      return SDL_SetError("Unexpected end of data");
+    }
+    img->payload = view.pos;
+    view.pos += Min(payload_len, view.Remaining());
+    if (SDL_SeekIO(io, view.pos - view_start, SDL_IO_SEEK_CUR) < 0) {
+      return false;
+    }
+  } else {
+    u8* payload = arena->Push<u8>(payload_len);
+    if (SDL_ReadIO(io, payload, payload_len) < payload_need) {
+      return SDL_SetError("Unexpected end of data");
+    }
+    img->payload = payload;
+  }
 
-        // GRAY4: advance one byte every 2 pixels
-        if (mode_tab[i] == 4) {
-          if ((tx & 1) == 1) {
-            src_off += 1;
-          }
-        } else {
-          src_off += src_step;
-        }
+  return true;
+}
 
-        dst_off += 3;
-      }
+struct BP3Job;
 
-      src_row_byte_off += bpp;
-    }
-  }
+// Interleave a decoded tile into 8 rows of 8 output pixels
+typedef void (*BP3TileStore)(u8* dst, const BP3Tile* tile, const BP3Job* job);
 
-  // create and fill the SDL surface (BGR24)
-  bmp->surf = SDL_CreateSurface(bpar.bp3.width, bpar.bp3.height, SDL_PIXELFORMAT_BGR24);
-  if (!bmp->surf || !SDL_LockSurface(bmp->surf)) {
-    return false;
-  }
+struct BP3Job
+{
+  const BP3Image*      img;
+  const BP3TileKernel* kernels;
+  BP3TileStore         store;
+  u8*                  pixels;
+  usize                pitch;
+
+  // Output format. 32-bit pixels are built from the channel shifts, with
+  // every other bit set so alpha comes out opaque
+  u32                  bytes_per_pixel;
+  u32                  r_shift;
+  u32                  g_shift;
+  u32                  b_shift;
+  u32                  fill;
+};
 
-  for (u32 y = 0; y < bpar.bp3.height; ++y) {
-    u8* dst = (u8*)bmp->surf->pixels + y * bmp->surf->pitch;
-    const u8* src = outbuf + (size_t)y * grid_row_bytes;
-    SDL_memcpy(dst, src, (size_t)bpar.bp3.width * 3u);
+// BGR24, or any 32-bit format with 8-bit channels
+static bool BP3_SetOutputFormat(BP3Job* job, SDL_PixelFormat format)
+{
+  if (format == SDL_PIXELFORMAT_BGR24) {
+    job->bytes_per_pixel = 3;
+    return true;
   }
 
-  if (!SDL_FlipSurface(bmp->surf, SDL_FLIP_VERTICAL)) {
+  const SDL_PixelFormatDetails* fmt = SDL_GetPixelFormatDetails(format);
+  if (!fmt) {
     return false;
   }
-
-  SDL_UnlockSurface(bmp->surf);
-
+  if (fmt->bytes_per_pixel != 4 || fmt->Rbits != 8 || fmt->Gbits != 8 || fmt->Bbits != 8) {
+    return SDL_SetError("Unsupported pixel format: %s", SDL_GetPixelFormatName(format));
+  }
+  job->bytes_per_pixel = 4;
+  job->r_shift         = fmt->Rshift;
+  job->g_shift         = fmt->Gshift;
+  job->b_shift         = fmt->Bshift;
+  job->fill            = ~(fmt->Rmask | fmt->Gmask | fmt->Bmask);
   return true;
 }
 
-//-----------------------------------------------------------------------------
-// TXT files
-//-----------------------------------------------------------------------------
+//
+// Tile stores
+//
 
-char* ShiftToUTF8(u8* shift_jis_string)
+static void BP3_Store24(u8* dst, const BP3Tile* tile, const BP3Job* job)
 {
-  usize utf8_len = cp932_to_utf8_len((char*)shift_jis_string);
-
-  char* result = MemAllocZ<char>(utf8_len + 1);
-  cp932_to_utf8(result, (char*)shift_jis_string);
-
-  return result;
+  for (u32 k = 0; k < 64; ++k) {
+    dst[3 * k + 0] = tile->b[k];
+    dst[3 * k + 1] = tile->g[k];
+    dst[3 * k + 2] = tile->r[k];
+  }
 }
 
-char* DecodeTXT_1997(SDL_IOStream* io)
+static void BP3_Store32(u8* dst, const BP3Tile* tile, const BP3Job* job)
 {
-  u8  txt_magic = 0;
-  u32 txt_len = 0;
-
-  if (!SDL_ReadU8(io, &txt_magic) || txt_magic != 1) {
-    SDL_SetError("File is not a TXT script");
-    return NULL;
-  }
-
-  if (!SDL_ReadU32LE(io, &txt_len)) {
-    return NULL;
+  u32* out = (u32*)dst;
+  for (u32 k = 0; k < 64; ++k) {
+    out[k] = job->fill |
+             ((u32)tile->b[k] << job->b_shift) |
+             ((u32)tile->g[k] << job->g_shift) |
+             ((u32)tile->r[k] << job->r_shift);
   }
+}
 
-  u8* data = MemAllocZ<u8>(txt_len + 1);
-  defer { MemFree(data); };
+#ifdef SDL_SSE2_INTRINSICS
 
-  if (SDL_ReadIO(io, data, txt_len) != txt_len) {
-    return NULL;
+SDL_TARGETING("sse2")
+static void BP3_Store32_SSE2(u8* dst, const BP3Tile* tile, const BP3Job* job)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i fill = _mm_set1_epi32((int)job->fill);
+  const __m128i bs   = _mm_cvtsi32_si128((int)job->b_shift);
+  const __m128i gs   = _mm_cvtsi32_si128((int)job->g_shift);
+  const __m128i rs   = _mm_cvtsi32_si128((int)job->r_shift);
+  for (u32 k = 0; k < 64; k += 16) {
+    const __m128i b = _mm_loadu_si128((const __m128i*)(tile->b + k));
+    const __m128i g = _mm_loadu_si128((const __m128i*)(tile->g + k));
+    const __m128i r = _mm_loadu_si128((const __m128i*)(tile->r + k));
+    const __m128i b16[2] = { _mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero) };
+    const __m128i g16[2] = { _mm_unpacklo_epi8(g, zero), _mm_unpackhi_epi8(g, zero) };
+    const __m128i r16[2] = { _mm_unpacklo_epi8(r, zero), _mm_unpackhi_epi8(r, zero) };
+    for (u32 h = 0; h < 2; ++h) {
+      // widen to 32-bit lanes, 4 pixels at a time
+      const __m128i lo = _mm_or_si128(
+        _mm_or_si128(_mm_sll_epi32(_mm_unpacklo_epi16(b16[h], zero), bs),
+                     _mm_sll_epi32(_mm_unpacklo_epi16(g16[h], zero), gs)),
+        _mm_or_si128(_mm_sll_epi32(_mm_unpacklo_epi16(r16[h], zero), rs), fill));
+      const __m128i hi = _mm_or_si128(
+        _mm_or_si128(_mm_sll_epi32(_mm_unpackhi_epi16(b16[h], zero), bs),
+                     _mm_sll_epi32(_mm_unpackhi_epi16(g16[h], zero), gs)),
+        _mm_or_si128(_mm_sll_epi32(_mm_unpackhi_epi16(r16[h], zero), rs), fill));
+      _mm_storeu_si128((__m128i*)(dst + 4 * (k + 8 * h)), lo);
+      _mm_storeu_si128((__m128i*)(dst + 4 * (k + 8 * h) + 16), hi);
+    }
   }
+}
 
-  for (u32 i = 0; i < txt_len; ++i) {
-    data[i] ^= 0xFF;
-  }
+#endif // SDL_SSE2_INTRINSICS
 
-  return ShiftToUTF8(data);
-}
+#ifdef SDL_SSE4_1_INTRINSICS
 
-char* DecodeTXT_2006(SDL_IOStream* io, usize len)
+SDL_TARGETING("sse4.1")
+static void BP3_Store24_SSE41(u8* dst, const BP3Tile* tile, const BP3Job* job)
 {
-  if (!len) {
-    if (SDL_SeekIO(io, 0, SDL_IO_SEEK_END) < 0) {
-      return NULL;
-    }
-    len = SDL_TellIO(io);
-    if (SDL_SeekIO(io, 0, SDL_IO_SEEK_SET) < 0) {
-      return NULL;
-    }
+  // pshufb masks scattering one channel of 16 pixels into three 16-byte stores
+  const __m128i b0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i r0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+  for (u32 k = 0; k < 64; k += 16) {
+    const __m128i b = _mm_loadu_si128((const __m128i*)(tile->b + k));
+    const __m128i g = _mm_loadu_si128((const __m128i*)(tile->g + k));
+    const __m128i r = _mm_loadu_si128((const __m128i*)(tile->r + k));
+    _mm_storeu_si128((__m128i*)(dst + 3 * k),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b0),
+                                               _mm_shuffle_epi8(g, g0)),
+                                  _mm_shuffle_epi8(r, r0)));
+    _mm_storeu_si128((__m128i*)(dst + 3 * k + 16),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b1),
+                                               _mm_shuffle_epi8(g, g1)),
+                                  _mm_shuffle_epi8(r, r1)));
+    _mm_storeu_si128((__m128i*)(dst + 3 * k + 32),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b, b2),
+                                               _mm_shuffle_epi8(g, g2)),
+                                  _mm_shuffle_epi8(r, r2)));
   }
+}
 
-  u8* data = MemAllocZ<u8>(len + 1);
-  defer { MemFree(data); };
+#endif // SDL_SSE4_1_INTRINSICS
 
-  if (SDL_ReadIO(io, data, len) != len) {
-    return NULL;
-  }
+#ifdef SDL_AVX2_INTRINSICS
 
-  for (u32 i = 0; i < len; ++i) {
-    if (data[i] > 0xF) {
-      data[i] = 0xE - data[i];
-    }
+SDL_TARGETING("avx2")
+static void BP3_Store32_AVX2(u8* dst, const BP3Tile* tile, const BP3Job* job)
+{
+  const __m256i fill = _mm256_set1_epi32((int)job->fill);
+  const __m128i bs   = _mm_cvtsi32_si128((int)job->b_shift);
+  const __m128i gs   = _mm_cvtsi32_si128((int)job->g_shift);
+  const __m128i rs   = _mm_cvtsi32_si128((int)job->r_shift);
+  for (u32 k = 0; k < 64; k += 8) {
+    const __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(tile->b + k)));
+    const __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(tile->g + k)));
+    const __m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(tile->r + k)));
+    _mm256_storeu_si256((__m256i*)(dst + 4 * k),
+                        _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(b, bs),
+                                                        _mm256_sll_epi32(g, gs)),
+                                        _mm256_or_si256(_mm256_sll_epi32(r, rs), fill)));
   }
-
-  return ShiftToUTF8(data);
 }
 
-//-----------------------------------------------------------------------------
+#endif // SDL_AVX2_INTRINSICS
+
+// Pick the best store for this CPU and output format, once
+static BP3TileStore BP3_GetStore(u32 bytes_per_pixel)
+{
+  static const BP3TileStore store24 = []() -> BP3TileStore {
+#ifdef SDL_SSE4_1_INTRINSICS
+    if (SDL_HasSSE41()) {
+      return BP3_Store24_SSE41;
+    }
+#endif
+    return BP3_Store24;
+  }();
+  static const BP3TileStore store32 = []() -> BP3TileStore {
+#ifdef SDL_AVX2_INTRINSICS
+    if (SDL_HasAVX2()) {
+      return BP3_Store32_AVX2;
+    }
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    if (SDL_HasSSE2()) {
+      return BP3_Store32_SSE2;
+    }
+#endif
+    return BP3_Store32;
+  }();
+  return bytes_per_pixel == 3 ? store24 : store32;
+}
+
+// Decode one row of tiles into the output. Tiles are independent once their
+// offsets are known, so rows can be decoded in any order
+static void BP3_DecodeTileRow(void* user, u32 row, u32 worker)
+{
+  const BP3Job* job = (const BP3Job*)user;
+  const BP3Image* img = job->img;
+  const u32 width         = img->bpar.bp3.width;
+  const u32 height        = img->bpar.bp3.height;
+  const u32 padded_w      = Align8(width);
+  const u32 padded_h      = Align8(height);
+  const u32 tiles_per_row = padded_w / 8;
+
+  // scratch for one tile (max 24 bpp * 8 rows = 192 bytes)
+  u8 tile_buf[192];
+  BP3Tile tile;
+  alignas(32) u8 pixels[64 * 4];
+
+  for (u32 col = 0; col < tiles_per_row; ++col) {
+    const u32 i = row * tiles_per_row + col;
+
+    // tile extents (handle right/bottom partial tiles)
+    u32 chunk_w = 8;
+    if (col * 8 + 8 >= width) {
+      chunk_w = width + 8 - padded_w;
+    }
+
+    u32 chunk_h = 8;
+    if (row * 8 + 8 >= height) {
+      chunk_h = height + 8 - padded_h;
+    }
+
+    const u32 bpp = BP3_MODE_BPP[img->mode_tab[i]];
+
+    // gather this tile's packed rows, padding each to 'bpp' bytes and the
+    // tile to 8 rows
+    SDL_memset(tile_buf, 0, sizeof(tile_buf));
+    if (bpp > 0) {
+      const u32 stored_row_bytes = (bpp * chunk_w) / 8;
+      const u8* src = img->payload + img->tile_offs[i];
+      for (u32 y = 0; y < chunk_h; ++y) {
+        SDL_memcpy(&tile_buf[y * bpp], src + y * stored_row_bytes, stored_row_bytes);
+      }
+    }
+
+    // decode and interleave the whole tile, then copy its visible part into
+    // the output. Rows are stored bottom-up
+    job->kernels[img->mode_tab[i]](&tile, tile_buf, &img->param_tab[3 * i]);
+    job->store(pixels, &tile, job);
+
+    const usize row_bytes = 8 * job->bytes_per_pixel;
+    for (u32 ty = 0; ty < chunk_h; ++ty) {
+      const u32 y = height - 1 - (row * 8 + ty);
+      SDL_memcpy(job->pixels + y * job->pitch + row_bytes * col, &pixels[ty * row_bytes],
+                 chunk_w * job->bytes_per_pixel);
+    }
+  }
+}
+
+static void BP3_Decode(BP3Job* job, const BP3Image* img, void* pixels, usize pitch,
+                       ThreadPool* pool)
+{
+  job->img     = img;
+  job->kernels = BP3_GetKernels();
+  job->store   = BP3_GetStore(job->bytes_per_pixel);
+  job->pixels  = (u8*)pixels;
+  job->pitch   = pitch;
+
+  const u32 tile_rows = Align8(img->bpar.bp3.height) / 8;
+  if (pool) {
+    pool->ParallelFor(tile_rows, BP3_DecodeTileRow, job);
+  } else {
+    for (u32 row = 0; row < tile_rows; ++row) {
+      BP3_DecodeTileRow(job, row, 0);
+    }
+  }
+}
+
+bool LoadBP3(Bitmap* bmp, SDL_IOStream* io, ThreadPool* pool, SDL_PixelFormat format,
+             Arena* arena)
+{
+  BP3Job job = { };
+  if (!BP3_SetOutputFormat(&job, format)) {
+    return false;
+  }
+
+  BP3Image img = { };
+  defer { BP3_FreeImage(&img); };
+  if (!BP3_LoadImage(&img, io, arena)) {
+    return false;
+  }
+
+  bmp->surf = SDL_CreateSurface(img.bpar.bp3.width, img.bpar.bp3.height, format);
+  if (!bmp->surf || !SDL_LockSurface(bmp->surf)) {
+    return false;
+  }
+
+  BP3_Decode(&job, &img, bmp->surf->pixels, bmp->surf->pitch, pool);
+
+  SDL_UnlockSurface(bmp->surf);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// TXT files
+//-----------------------------------------------------------------------------
+
+// In-place de-obfuscation of TXT data. Each transform has a scalar, SSE2 and
+// AVX2 version, and is fused with the search for the NUL padding at the end
+
+struct TXT_Xor1997
+{
+  static inline u8 Scalar(u8 b)
+  {
+    return b ^ 0xFF;
+  }
+#ifdef SDL_SSE2_INTRINSICS
+  SDL_TARGETING("sse2") static inline __m128i SSE2(__m128i v)
+  {
+    return _mm_xor_si128(v, _mm_set1_epi8((char)0xFF));
+  }
+#endif
+#ifdef SDL_AVX2_INTRINSICS
+  SDL_TARGETING("avx2") static inline __m256i AVX2(__m256i v)
+  {
+    return _mm256_xor_si256(v, _mm256_set1_epi8((char)0xFF));
+  }
+#endif
+};
+
+struct TXT_Sub2006
+{
+  static inline u8 Scalar(u8 b)
+  {
+    return (b > 0xF) ? (u8)(0xE - b) : b;
+  }
+  // x86 has no unsigned byte compare, but b > 0xF is max(b, 0x10) == b
+#ifdef SDL_SSE2_INTRINSICS
+  SDL_TARGETING("sse2") static inline __m128i SSE2(__m128i v)
+  {
+    const __m128i high = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x10)), v);
+    const __m128i sub  = _mm_sub_epi8(_mm_set1_epi8(0xE), v);
+    return _mm_or_si128(_mm_and_si128(high, sub), _mm_andnot_si128(high, v));
+  }
+#endif
+#ifdef SDL_AVX2_INTRINSICS
+  SDL_TARGETING("avx2") static inline __m256i AVX2(__m256i v)
+  {
+    const __m256i high = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x10)), v);
+    return _mm256_blendv_epi8(v, _mm256_sub_epi8(_mm256_set1_epi8(0xE), v), high);
+  }
+#endif
+};
+
+// Transform data[i, len). end is the text length found before i. Returns
+// the length without trailing NULs
+template <typename OP>
+static usize TXT_DecodeScalar(u8* data, usize len, usize i, usize end)
+{
+  for (; i < len; ++i) {
+    data[i] = OP::Scalar(data[i]);
+    if (data[i] != 0) {
+      end = i + 1;
+    }
+  }
+  return end;
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+
+template <typename OP>
+SDL_TARGETING("sse2")
+static usize TXT_DecodeSSE2(u8* data, usize len)
+{
+  usize end = 0;
+  usize i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const __m128i v = OP::SSE2(_mm_loadu_si128((const __m128i*)(data + i)));
+    _mm_storeu_si128((__m128i*)(data + i), v);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) {
+      end = i + 16;
+    }
+  }
+  // Trim inside the last block that had text
+  while (end > 0 && data[end - 1] == 0) {
+    --end;
+  }
+  return TXT_DecodeScalar<OP>(data, len, i, end);
+}
+
+#endif // SDL_SSE2_INTRINSICS
+
+#ifdef SDL_AVX2_INTRINSICS
+
+template <typename OP>
+SDL_TARGETING("avx2")
+static usize TXT_DecodeAVX2(u8* data, usize len)
+{
+  usize end = 0;
+  usize i = 0;
+  for (; i + 32 <= len; i += 32) {
+    const __m256i v = OP::AVX2(_mm256_loadu_si256((const __m256i*)(data + i)));
+    _mm256_storeu_si256((__m256i*)(data + i), v);
+    if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) != 0xFFFFFFFF) {
+      end = i + 32;
+    }
+  }
+  // Trim inside the last block that had text
+  while (end > 0 && data[end - 1] == 0) {
+    --end;
+  }
+  return TXT_DecodeScalar<OP>(data, len, i, end);
+}
+
+#endif // SDL_AVX2_INTRINSICS
+
+// Transform data in place and return the length of the text, not counting
+// any NUL padding at the end
+template <typename OP>
+static usize TXT_Decode(u8* data, usize len)
+{
+#ifdef SDL_AVX2_INTRINSICS
+  static const bool has_avx2 = SDL_HasAVX2();
+  if (has_avx2) {
+    return TXT_DecodeAVX2<OP>(data, len);
+  }
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+  static const bool has_sse2 = SDL_HasSSE2();
+  if (has_sse2) {
+    return TXT_DecodeSSE2<OP>(data, len);
+  }
+#endif
+  return TXT_DecodeScalar<OP>(data, len, 0, 0);
+}
+
+// ASCII maps to itself in cp932, so runs of it are copied in blocks and only
+// the bytes in between go through the cp932 tables. Each copier returns the
+// length of the ASCII run at the start of src
+typedef usize (*ShiftCopyASCIIFunc)(char* dst, const u8* src, usize len);
+
+static usize ShiftCopyASCIIScalar(char* dst, const u8* src, usize len)
+{
+  usize i = 0;
+  while (i < len && src[i] < 0x80) {
+    dst[i] = (char)src[i];
+    ++i;
+  }
+  return i;
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+
+SDL_TARGETING("sse2")
+static usize ShiftCopyASCIISSE2(char* dst, const u8* src, usize len)
+{
+  usize i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    if (_mm_movemask_epi8(v)) {
+      break;
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), v);
+  }
+  return i + ShiftCopyASCIIScalar(dst + i, src + i, len - i);
+}
+
+#endif // SDL_SSE2_INTRINSICS
+
+#ifdef SDL_AVX2_INTRINSICS
+
+SDL_TARGETING("avx2")
+static usize ShiftCopyASCIIAVX2(char* dst, const u8* src, usize len)
+{
+  usize i = 0;
+  for (; i + 32 <= len; i += 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+    if (_mm256_movemask_epi8(v)) {
+      break;
+    }
+    _mm256_storeu_si256((__m256i*)(dst + i), v);
+  }
+  return i + ShiftCopyASCIIScalar(dst + i, src + i, len - i);
+}
+
+#endif // SDL_AVX2_INTRINSICS
+
+// Convert len bytes of Shift-JIS into dst, which must hold
+// UTF8_PER_CP932 * len bytes. Returns the number of bytes written
+static usize ShiftToUTF8Into(char* dst, const u8* src, usize len)
+{
+  static const ShiftCopyASCIIFunc copy_ascii = []() {
+#ifdef SDL_AVX2_INTRINSICS
+    if (SDL_HasAVX2()) {
+      return ShiftCopyASCIIAVX2;
+    }
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    if (SDL_HasSSE2()) {
+      return ShiftCopyASCIISSE2;
+    }
+#endif
+    return ShiftCopyASCIIScalar;
+  }();
+
+  usize n = 0;
+  usize i = 0;
+  while (i < len) {
+    const usize ascii = copy_ascii(dst + n, src + i, len - i);
+    n += ascii;
+    i += ascii;
+    if (i < len) {
+      // Trail bytes can be ASCII too, so cp932 decides where the run ends
+      usize used = 0;
+      n += cp932_to_utf8_run(dst + n, (const char*)src + i, len - i, &used);
+      i += used;
+    }
+  }
+  return n;
+}
+
+// Convert len bytes of Shift-JIS in one pass, NULs included. The result is
+// NUL-terminated as well
+static Span<char> ShiftToUTF8(const u8* shift_jis, usize len)
+{
+  char* result = MemAlloc<char>(UTF8_PER_CP932 * len + 1);
+  const usize n = ShiftToUTF8Into(result, shift_jis, len);
+  result[n] = '\0';
+
+  // Give back the worst-case slack
+  result = (char*)SDL_realloc(result, n + 1);
+  SDL_assert(result && "allocation failed");
+  return Span<char>(result, n);
+}
+
+// Read len bytes from a stream of unknown size into a new buffer, freed with
+// SDL_free. The buffer grows as data arrives, so a bogus len fails on the
+// short read instead of being allocated up front
+static u8* ReadIOGrowing(SDL_IOStream* io, usize len)
+{
+  u8* buf = NULL;
+  usize cap = 0;
+  while (cap < len) {
+    const usize got = cap;
+    cap = Min(len, Max<usize>(2 * cap, 64 << 10));
+    u8* grown = (u8*)SDL_realloc(buf, cap);
+    SDL_assert(grown && "allocation failed");
+    buf = grown;
+    if (SDL_ReadIO(io, buf + got, cap - got) != cap - got) {
+      SDL_free(buf);
+      return NULL;
+    }
+  }
+  return buf ? buf : (u8*)SDL_malloc(1);
+}
+
+// De-obfuscate and convert len bytes of TXT data from io. With an arena, the
+// text is pushed at its worst-case size and shrunk to fit once converted,
+// otherwise it's allocated to fit. The raw data is only temporary
+template <typename OP>
+static Span<char> TXT_Load(SDL_IOStream* io, usize len, Arena* arena)
+{
+  // len comes from the file, so check it against what's left of the stream
+  // before pushing anything for it. Streams of unknown size are read up front
+  // instead, so a bad len only costs the bytes that are really there
+  u8* owned = NULL;
+  defer { SDL_free(owned); };
+  const Sint64 size = SDL_GetIOSize(io);
+  const Sint64 pos  = SDL_TellIO(io);
+  if (size >= 0 && pos >= 0) {
+    if ((u64)len > (u64)Max<Sint64>(size - pos, 0)) {
+      SDL_SetError("Unexpected end of data");
+      return { };
+    }
+  } else if (!(owned = ReadIOGrowing(io, len))) {
+    return { };
+  }
+
+  const usize cap = UTF8_PER_CP932 * len + 1;
+  const ArenaMark start = arena ? arena->Mark() : ArenaMark{ };
+  char* text = arena ? arena->Push<char>(cap) : NULL;
+
+  // The raw data goes after the text, so the text is the last push on arena
+  // again once the scratch is reset
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  u8* data = owned;
+  if (!data) {
+    data = scratch->Push<u8>(len);
+    if (SDL_ReadIO(io, data, len) != len) {
+      scratch->Reset(mark);
+      if (arena) {
+        arena->Reset(start);
+      }
+      return { };
+    }
+  }
+
+  const usize text_len = TXT_Decode<OP>(data, len);
+  if (!text) {
+    Span<char> result = ShiftToUTF8(data, text_len);
+    scratch->Reset(mark);
+    return result;
+  }
+  const usize n = ShiftToUTF8Into(text, data, text_len);
+  text[n] = '\0';
+  scratch->Reset(mark);
+  arena->Shrink(text, cap, n + 1);
+  return Span<char>(text, n);
+}
+
+Span<char> DecodeTXT_1997(SDL_IOStream* io, Arena* arena)
+{
+  u8  txt_magic = 0;
+  u32 txt_len = 0;
+
+  if (!SDL_ReadU8(io, &txt_magic) || txt_magic != 1) {
+    SDL_SetError("File is not a TXT script");
+    return { };
+  }
+
+  if (!SDL_ReadU32LE(io, &txt_len)) {
+    return { };
+  }
+
+  return TXT_Load<TXT_Xor1997>(io, txt_len, arena);
+}
+
+Span<char> DecodeTXT_2006(SDL_IOStream* io, usize len, Arena* arena)
+{
+  if (!len) {
+    if (SDL_SeekIO(io, 0, SDL_IO_SEEK_END) < 0) {
+      return { };
+    }
+    len = SDL_TellIO(io);
+    if (SDL_SeekIO(io, 0, SDL_IO_SEEK_SET) < 0) {
+      return { };
+    }
+  }
+
+  return TXT_Load<TXT_Sub2006>(io, len, arena);
+}
+
+//-----------------------------------------------------------------------------
 // BIN/LB5 files
 //-----------------------------------------------------------------------------
 
-static bool LoadBinIDX(Span<PackEntry>* entries, SDL_IOStream* src)
+// Growable buffer that all entry names are decoded into. It may move while
+// it grows, so each entry's name offset is kept in offs until loading is
+// finished
+struct NamePool
 {
+  char*  buf;
+  usize  len;
+  usize  cap;
+  usize* offs;
+};
+
+// Set up a pool for count names. offs is scratch, so the caller must hold a
+// scratch arena mark until FinishEntryNames
+static void InitEntryNames(NamePool* pool, u32 count, usize cap)
+{
+  pool->cap  = cap;
+  pool->buf  = MemAlloc<char>(Max<usize>(cap, 1));
+  pool->offs = GetScratchArena()->Push<usize>(count);
+}
+
+static void PushEntryName(NamePool* pool, u32 i, const char* name_jis)
+{
+  const usize jis_len = SDL_strlen(name_jis);
+  const usize max_len = UTF8_PER_CP932 * jis_len + 1;
+  if (pool->len + max_len > pool->cap) {
+    pool->cap = Max<usize>(pool->cap * 2, pool->len + max_len);
+    pool->buf = (char*)SDL_realloc(pool->buf, pool->cap);
+    SDL_assert(pool->buf && "allocation failed");
+  }
+  const usize off = pool->len;
+  const usize n = ShiftToUTF8Into(pool->buf + off, (const u8*)name_jis, jis_len);
+  pool->buf[off + n] = '\0';
+  pool->len += n + 1;
+  pool->offs[i] = off;
+}
+
+// Trim the pool and point every entry at its name
+static void FinishEntryNames(PackFile* pack, NamePool* pool)
+{
+  if (pool->len > 0) {
+    pool->buf = (char*)SDL_realloc(pool->buf, pool->len);
+    SDL_assert(pool->buf && "allocation failed");
+  }
+  for (usize i = 0; i < pack->entries.len; ++i) {
+    pack->entries[i].name = pool->buf + pool->offs[i];
+  }
+  pack->names = pool->buf;
+}
+
+static bool LoadBinIDX(PackFile* pack, Span<u8> idx)
+{
+  Span<PackEntry>* entries = &pack->entries;
+  ByteReader src(idx);
   u32 len = 0;
-  if (!SDL_ReadU32LE(src, &len)) {
+  if (!src.ReadU32LE(&len)) {
     return false;
   }
+  // Each entry is at least its name length, offset and length
+  if (src.Remaining() / 12 < len) {
+    return SDL_SetError("Malformed index");
+  }
   entries->len = len;
 
   if (entries->len > 0) {
     entries->buf = MemAlloc<PackEntry>(entries->len);
   }
 
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  defer { scratch->Reset(mark); };
+
+  NamePool pool = { };
+  InitEntryNames(&pool, len, (usize)len * 16);
+
+  // Reused for every entry, names are short
+  u32 name_cap = 64;
+  u8* name_jis = MemAlloc<u8>(name_cap);
+  defer { MemFree(name_jis); };
+
   bool ok = true;
   for (u32 i = 0; i < len && ok; ++i) {
     PackEntry* entry = &entries->Get(i);
     u32 name_len;
-    if (!(ok &= SDL_ReadU32LE(src, &name_len))) {
+    if (!(ok &= src.ReadU32LE(&name_len))) {
       break;
     }
 
-    u8* name_jis = MemAllocZ<u8>(name_len + 1);
-    defer { MemFree(name_jis); };
-    if (!(ok &= (SDL_ReadIO(src, name_jis, name_len) == name_len))) {
+    if (name_len >= src.Remaining()) {
+      ok = SDL_SetError("Malformed index");
       break;
     }
+    if (name_len + 1 > name_cap) {
+      MemFree(name_jis);
+      name_cap = name_len + 1;
+      name_jis = MemAlloc<u8>(name_cap);
+    }
+    if (!(ok &= src.Read(name_jis, name_len))) {
+      break;
+    }
+    name_jis[name_len] = 0;
 
     ok &=
-      SDL_ReadU32LE(src, &entry->off) &&
-      SDL_ReadU32LE(src, &entry->len);
+      src.ReadU32LE(&entry->off) &&
+      src.ReadU32LE(&entry->len);
 
     if (ok) {
-      entry->name = MemAllocZ<char>(cp932_to_utf8_len((const char*)name_jis));
-      cp932_to_utf8(entry->name, (const char*)name_jis);
+      PushEntryName(&pool, i, (const char*)name_jis);
     }
   }
 
   if (!ok) {
+    MemFree(pool.buf);
     MemFree(entries->buf);
+    return false;
   }
 
-  return ok;
+  FinishEntryNames(pack, &pool);
+  return true;
 }
 
-static bool LoadLB5IDX(Span<PackEntry>* entries, SDL_IOStream* src)
+static bool LoadLB5IDX(PackFile* pack, Span<u8> idx)
 {
+  Span<PackEntry>* entries = &pack->entries;
+  ByteReader src(idx);
   u32 len = 0;
-  if (!SDL_ReadU32LE(src, &len)) {
+  if (!src.ReadU32LE(&len)) {
     return false;
   }
+  // Entries are fixed size
+  if (src.Remaining() / 24 < len) {
+    return SDL_SetError("Malformed index");
+  }
   entries->len = len;
 
   if (entries->len > 0) {
     entries->buf = MemAlloc<PackEntry>(entries->len);
   }
 
+  // Names are at most 15 cp932 bytes, mostly ASCII
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  defer { scratch->Reset(mark); };
+
+  NamePool pool = { };
+  InitEntryNames(&pool, len, (usize)len * 16);
+
   bool ok = true;
   for (u32 i = 0; i < len && ok; ++i) {
     PackEntry* entry = &entries->Get(i);
-    u8 name_jis[15] = { };
+    u8 name_jis[16] = { };
     ok &=
-      SDL_ReadU32LE(src, &entry->off) &&
-      SDL_ReadU32LE(src, &entry->len) &&
-      SDL_SeekIO(src, 1, SDL_IO_SEEK_CUR) >= 0;
+      src.ReadU32LE(&entry->off) &&
+      src.ReadU32LE(&entry->len) &&
+      src.Skip(1) &&
+      src.Read(name_jis, 15);
 
-    ok &= (SDL_ReadIO(src, name_jis, sizeof(name_jis)) == sizeof(name_jis));
-      
     if (ok) {
-      entry->name = MemAllocZ<char>(64);
-      cp932_to_utf8(entry->name, (const char*)name_jis);
+      PushEntryName(&pool, i, (const char*)name_jis);
     }
   }
 
   if (!ok) {
+    MemFree(pool.buf);
     MemFree(entries->buf);
+    return false;
   }
 
-  return ok;
+  FinishEntryNames(pack, &pool);
+  return true;
 }
 
-bool OpenPackFile(PackFile* pack, const char* path)
+// FNV-1a over ASCII-lowercased bytes. The game mixes .BMP and .bmp
+static u32 HashEntryName(const char* name)
+{
+  u32 hash = 0x811C9DC5;
+  for (const char* c = name; *c; ++c) {
+    hash ^= (u8)SDL_tolower((u8)*c);
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+static bool EntryNameEquals(const char* a, const char* b)
+{
+  for (; *a && *b; ++a, ++b) {
+    if (SDL_tolower((u8)*a) != SDL_tolower((u8)*b)) {
+      return false;
+    }
+  }
+  return *a == *b;
+}
+
+static void BuildPackIndex(PackFile* pack)
+{
+  u32 cap = 16;
+  while (cap < pack->entries.len * 2) {
+    cap *= 2;
+  }
+  pack->index      = MemAllocZ<u32>(cap);
+  pack->index_mask = cap - 1;
+
+  for (u32 i = 0; i < pack->entries.len; ++i) {
+    const char* name = pack->entries[i].name;
+    u32 slot = HashEntryName(name) & pack->index_mask;
+    while (pack->index[slot]) {
+      // Keep the first of any duplicate names, like a linear search would
+      if (EntryNameEquals(pack->entries[pack->index[slot] - 1].name, name)) {
+        break;
+      }
+      slot = (slot + 1) & pack->index_mask;
+    }
+    if (!pack->index[slot]) {
+      pack->index[slot] = i + 1;
+    }
+  }
+}
+
+// Same path with the extension replaced by .idx
+static char* IdxPathFor(const char* path)
+{
+  usize path_len = SDL_strlen(path);
+  char* idx_path = SDL_strdup(path);
+  SDL_memcpy(idx_path + path_len - 3, "idx", 3);
+  return idx_path;
+}
+
+static bool EntryInBounds(const PackEntry* entry, u64 lump_len)
+{
+  return (u64)entry->off + (u64)entry->len <= lump_len;
+}
+
+// Load the .idx that belongs to path without opening the lump itself
+static bool LoadPackIndex(PackFile* pack, const char* path)
 {
   const char* ext = Extension(path);
   if (!ext) {
     return SDL_SetError("Invalid file");
   }
 
-  pack->lump_file = SDL_IOFromFile(path, "rb");
-  if (!pack->lump_file) {
-    return false;
-  }
-
   const bool is_bin = !SDL_strcasecmp(ext, "bin");
   const bool is_lb5 = !SDL_strcasecmp(ext, "lb5");
   if (!is_bin && !is_lb5) {
     return SDL_SetError("Invalid file");
   }
 
-  // Replace extension with .idx
-  usize path_len = SDL_strlen(path);
-  char* idx_path = SDL_strdup(path);
-  strncpy(idx_path + path_len - 3, "idx", 3);
-
+  char* idx_path = IdxPathFor(path);
   defer { SDL_free(idx_path); };
 
-  SDL_IOStream* idx_io = SDL_IOFromFile(idx_path, "rb");
-  if (!idx_io) {
+  // Read the whole index at once and parse it from memory
+  Span<u8> idx = { };
+  idx.buf = (u8*)SDL_LoadFile(idx_path, &idx.len);
+  if (!idx.buf) {
     return false;
   }
+  defer { SDL_free(idx.buf); };
 
-  if (is_bin) {
-    return LoadBinIDX(&pack->entries, idx_io);
+  bool ok = is_bin ? LoadBinIDX(pack, idx)
+                   : LoadLB5IDX(pack, idx);
+  if (!ok) {
+    pack->entries = { };
+    return false;
   }
-  if (is_lb5) {
-    return LoadLB5IDX(&pack->entries, idx_io);
+
+  BuildPackIndex(pack);
+
+  return true;
+}
+
+bool OpenPackFile(PackFile* pack, const char* path)
+{
+  if (!LoadPackIndex(pack, path)) {
+    return false;
   }
-  return SDL_SetError("Invalid file");
+
+  // Prefer mapping the lump so entries can be viewed without copying
+  if (!MapFile(&pack->lump_map, path) || !pack->lump_map.data.buf) {
+    pack->lump_file = SDL_IOFromFile(path, "rb");
+    const Sint64 lump_len = pack->lump_file ? SDL_GetIOSize(pack->lump_file) : -1;
+    if (lump_len < 0) {
+      pack->Close();
+      return false;
+    }
+    pack->lump_len = (u64)lump_len;
+  }
+
+  return true;
 }
 
 void PackFile::Close()
 {
-  SDL_CloseIO(lump_file);
-  for (PackEntry* e = entries.Begin(); e != entries.End(); ++e) {
-    MemFree(e->name);
+  UnmapFile(&lump_map);
+  if (lump_file) {
+    SDL_CloseIO(lump_file);
   }
   MemFree(entries.buf);
+  MemFree(names);
+  MemFree(index);
+  *this = { };
 }
 
 void* PackFile::ReadEntry(const PackEntry* entry)
 {
-  if (SDL_SeekIO(lump_file, entry->off, SDL_IO_SEEK_SET) < 0) {
+  if (lump_map.data.buf) {
+    Span<const u8> view = ViewEntry(entry);
+    if (!view.buf) {
+      return NULL;
+    }
+    void* result = MemAlloc<u8>(entry->len);
+    SDL_memcpy(result, view.buf, entry->len);
+    return result;
+  }
+
+  if (!EntryInBounds(entry, lump_len)) {
+    SDL_SetError("Entry %s is out of bounds", entry->name);
     return NULL;
   }
 
   void* result = MemAlloc<u8>(entry->len);
-  if (SDL_ReadIO(lump_file, result, entry->len) != entry->len) {
+  if (!ReadIOAt(lump_file, entry->off, result, entry->len)) {
     MemFree(result);
     return NULL;
   }
 
   return result;
 }
+
+// Window over one entry of an unmapped lump
+struct EntryStream
+{
+  SDL_IOStream* lump;
+  u64           off;
+  u64           len;
+  u64           pos;
+};
+
+static Sint64 EntryStreamSize(void* user)
+{
+  return (Sint64)((EntryStream*)user)->len;
+}
+
+static Sint64 EntryStreamSeek(void* user, Sint64 offset, SDL_IOWhence whence)
+{
+  EntryStream* es = (EntryStream*)user;
+  Sint64 base = 0;
+  switch (whence) {
+  case SDL_IO_SEEK_SET: {
+    base = 0;
+  } break;
+  case SDL_IO_SEEK_CUR: {
+    base = (Sint64)es->pos;
+  } break;
+  case SDL_IO_SEEK_END: {
+    base = (Sint64)es->len;
+  } break;
+  default: {
+    SDL_SetError("Invalid whence");
+    return -1;
+  } break;
+  }
+  const Sint64 pos = base + offset;
+  if (pos < 0) {
+    SDL_SetError("Seek before start of entry");
+    return -1;
+  }
+  es->pos = Min<u64>((u64)pos, es->len);
+  return (Sint64)es->pos;
+}
+
+static usize EntryStreamRead(void* user, void* ptr, usize size, SDL_IOStatus* status)
+{
+  EntryStream* es = (EntryStream*)user;
+  const usize len = (usize)Min<u64>(size, es->len - es->pos);
+  if (len == 0) {
+    *status = SDL_IO_STATUS_EOF;
+    return 0;
+  }
+  if (!ReadIOAt(es->lump, es->off + es->pos, ptr, len)) {
+    *status = SDL_IO_STATUS_ERROR;
+    return 0;
+  }
+  es->pos += len;
+  return len;
+}
+
+static bool EntryStreamClose(void* user)
+{
+  MemFree((EntryStream*)user);
+  return true;
+}
+
+SDL_IOStream* PackFile::OpenEntry(const PackEntry* entry)
+{
+  if (lump_map.data.buf) {
+    Span<const u8> view = ViewEntry(entry);
+    if (!view.buf) {
+      return NULL;
+    }
+    return SDL_IOFromConstMem(view.buf, view.len);
+  }
+
+  if (!EntryInBounds(entry, lump_len)) {
+    SDL_SetError("Entry %s is out of bounds", entry->name);
+    return NULL;
+  }
+
+  EntryStream* es = MemAllocZ<EntryStream>();
+  es->lump = lump_file;
+  es->off  = entry->off;
+  es->len  = entry->len;
+
+  SDL_IOStreamInterface iface;
+  SDL_INIT_INTERFACE(&iface);
+  iface.size  = EntryStreamSize;
+  iface.seek  = EntryStreamSeek;
+  iface.read  = EntryStreamRead;
+  iface.close = EntryStreamClose;
+
+  SDL_IOStream* io = SDL_OpenIO(&iface, es);
+  if (!io) {
+    MemFree(es);
+  }
+  return io;
+}
+
+PackEntry* PackFile::FindEntry(const char* name)
+{
+  if (!index) {
+    return NULL;
+  }
+  u32 slot = HashEntryName(name) & index_mask;
+  while (index[slot]) {
+    PackEntry* e = &entries[index[slot] - 1];
+    if (EntryNameEquals(e->name, name)) {
+      return e;
+    }
+    slot = (slot + 1) & index_mask;
+  }
+  return NULL;
+}
+
+Span<const u8> PackFile::ViewEntry(const PackEntry* entry)
+{
+  if (!lump_map.data.buf) {
+    return { };
+  }
+  if (!EntryInBounds(entry, lump_map.data.len)) {
+    SDL_SetError("Entry %s is out of bounds", entry->name);
+    return { };
+  }
+  return Span<const u8>(lump_map.data.buf + entry->off, entry->len);
+}
+
+static u8* PutU32LE(u8* p, u32 v)
+{
+  p[0] = (u8)(v >> 0);
+  p[1] = (u8)(v >> 8);
+  p[2] = (u8)(v >> 16);
+  p[3] = (u8)(v >> 24);
+  return p + 4;
+}
+
+// Longest name that fits in an LB5 index entry, in cp932 bytes
+#define LB5_MAX_NAME 15
+
+// Convert an entry name to cp932 in dst, which needs strlen(name) + 1 bytes
+// since utf8_to_cp932 never grows its input. Fails if a character converts
+// to a NUL, which the index couldn't hold
+static bool EntryNameToCP932(char* dst, const char* name, usize* jis_len)
+{
+  utf8_to_cp932(dst, name);
+  *jis_len = SDL_strlen(dst);
+  if (*jis_len != utf8_to_cp932_len(name)) {
+    return SDL_SetError("Name can't be stored as Shift-JIS: %s", name);
+  }
+  return true;
+}
+
+// Fail if name can't be written to an index
+static bool CheckEntryName(const char* name, bool is_lb5)
+{
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  defer { scratch->Reset(mark); };
+
+  usize jis_len = 0;
+  if (!EntryNameToCP932(scratch->Push<char>(SDL_strlen(name) + 1), name, &jis_len)) {
+    return false;
+  }
+  if (is_lb5 && jis_len > LB5_MAX_NAME) {
+    return SDL_SetError("Name too long for LB5: %s", name);
+  }
+  return true;
+}
+
+// Serialize entries in the layout of misc/patterns/idx_bin.hexpat or
+// idx_lb5.hexpat and write it to path in one go
+static bool WritePackIDX(const char* path, Span<PackEntry> entries, bool is_lb5)
+{
+  Arena* scratch = GetScratchArena();
+  const ArenaMark mark = scratch->Mark();
+  defer { scratch->Reset(mark); };
+
+  // Convert every name first so the size and the contents agree
+  Span<char>* names_jis = scratch->Push<Span<char>>(entries.len);
+  usize idx_len = 4;
+  for (usize i = 0; i < entries.len; ++i) {
+    const char* name = entries[i].name;
+    Span<char>* jis = &names_jis[i];
+    jis->buf = scratch->Push<char>(SDL_strlen(name) + 1);
+    if (!EntryNameToCP932(jis->buf, name, &jis->len)) {
+      return false;
+    }
+    if (is_lb5 && jis->len > LB5_MAX_NAME) {
+      return SDL_SetError("Name too long for LB5: %s", name);
+    }
+    idx_len += is_lb5 ? 24 : 12 + jis->len;
+  }
+
+  u8* idx = scratch->PushZ<u8>(idx_len);
+  u8* p = PutU32LE(idx, (u32)entries.len);
+  for (usize i = 0; i < entries.len; ++i) {
+    const PackEntry* e = &entries[i];
+    const Span<char> jis = names_jis[i];
+    if (is_lb5) {
+      p = PutU32LE(p, e->off);
+      p = PutU32LE(p, e->len);
+      p += 1;
+      SDL_memcpy(p, jis.buf, jis.len);
+      p += LB5_MAX_NAME;
+    } else {
+      p = PutU32LE(p, (u32)jis.len);
+      SDL_memcpy(p, jis.buf, jis.len);
+      p += jis.len;
+      p = PutU32LE(p, e->off);
+      p = PutU32LE(p, e->len);
+    }
+  }
+  SDL_assert(p == idx + idx_len);
+
+  return SDL_SaveFile(path, idx, idx_len);
+}
+
+bool BeginPackFile(PackWriter* writer, const char* path)
+{
+  *writer = { };
+
+  const char* ext = Extension(path);
+  if (!ext || (SDL_strcasecmp(ext, "bin") && SDL_strcasecmp(ext, "lb5"))) {
+    return SDL_SetError("Invalid file");
+  }
+
+  writer->lump_file = SDL_IOFromFile(path, "wb");
+  if (!writer->lump_file) {
+    return false;
+  }
+  writer->lump_path = SDL_strdup(path);
+  writer->is_lb5    = !SDL_strcasecmp(ext, "lb5");
+  return true;
+}
+
+bool PackWriter::AddEntry(const char* name, SDL_IOStream* src, u64 len)
+{
+  if (!CheckEntryName(name, is_lb5)) {
+    return false;
+  }
+  // Lookups are by name, so a second copy could never be found
+  for (PackEntry* e = entries.Begin(); e != entries.End(); ++e) {
+    if (EntryNameEquals(e->name, name)) {
+      return SDL_SetError("Duplicate entry name: %s", name);
+    }
+  }
+  if (lump_len + len > SDL_MAX_UINT32) {
+    return SDL_SetError("Archive would exceed 4 GiB");
+  }
+
+  if (!CopyIO(lump_file, src, len)) {
+    return false;
+  }
+
+  if (entries.len == entries_cap) {
+    entries_cap = Max<u32>(entries_cap * 2, 64);
+    entries.buf = (PackEntry*)SDL_realloc(entries.buf, sizeof(PackEntry) * entries_cap);
+    SDL_assert(entries.buf && "allocation failed");
+  }
+  PackEntry* e = &entries.buf[entries.len++];
+  e->off  = (u32)lump_len;
+  e->len  = (u32)len;
+  e->name = SDL_strdup(name);
+
+  lump_len += len;
+  return true;
+}
+
+static void FreePackWriter(PackWriter* writer)
+{
+  for (PackEntry* e = writer->entries.Begin(); e != writer->entries.End(); ++e) {
+    SDL_free(e->name);
+  }
+  MemFree(writer->entries.buf);
+  SDL_free(writer->lump_path);
+  *writer = { };
+}
+
+bool PackWriter::Finish()
+{
+  bool ok = SDL_CloseIO(lump_file);
+  lump_file = NULL;
+
+  if (ok) {
+    char* idx_path = IdxPathFor(lump_path);
+    ok = WritePackIDX(idx_path, entries, is_lb5);
+    SDL_free(idx_path);
+  }
+
+  FreePackWriter(this);
+  return ok;
+}
+
+void PackWriter::Abort()
+{
+  if (lump_file) {
+    SDL_CloseIO(lump_file);
+  }
+  if (lump_path) {
+    SDL_RemovePath(lump_path);
+  }
+  FreePackWriter(this);
+}
+
+// Delete a temporary file without clobbering the error that caused it
+static void DiscardTempFile(const char* path)
+{
+  char* err = SDL_strdup(SDL_GetError());
+  SDL_RemovePath(path);
+  SDL_SetError("%s", err);
+  SDL_free(err);
+}
+
+// Move a backup back over path after a failed replace, without clobbering the
+// error that caused it
+static void RestoreFile(const char* backup, const char* path)
+{
+  char* err = SDL_strdup(SDL_GetError());
+  SDL_RenameFile(backup, path);
+  SDL_SetError("%s", err);
+  SDL_free(err);
+}
+
+// Write to a temporary file and rename it over the index, so the old index
+// stays intact until the new one is complete
+static bool ReplacePackIDX(const char* path, Span<PackEntry> entries, bool is_lb5)
+{
+  char* idx_path = IdxPathFor(path);
+  defer { SDL_free(idx_path); };
+
+  char tmp_path[GOS_MAX_PATH];
+  SDL_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+
+  if (!WritePackIDX(tmp_path, entries, is_lb5) || !SDL_RenameFile(tmp_path, idx_path)) {
+    DiscardTempFile(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+bool UpdatePackFile(const char* path, Span<PackUpdate> updates)
+{
+  PackFile pack = { };
+  if (!LoadPackIndex(&pack, path)) {
+    return false;
+  }
+  defer { pack.Close(); };
+
+  const bool is_lb5 = !SDL_strcasecmp(Extension(path), "lb5");
+
+  // Entries as they'll be written, with room for every update being new
+  Span<PackEntry> out(MemAlloc<PackEntry>(pack.entries.len + updates.len),
+                      pack.entries.len);
+  defer { MemFree(out.buf); };
+  if (pack.entries.len > 0) {
+    SDL_memcpy(out.buf, pack.entries.buf, sizeof(PackEntry) * pack.entries.len);
+  }
+
+  // Everything is appended, so the bytes the old index points at are never
+  // touched. If anything fails the archive is unchanged apart from some
+  // unreferenced bytes at the end of the lump
+  SDL_IOStream* lump = SDL_IOFromFile(path, "r+b");
+  if (!lump) {
+    return false;
+  }
+  const Sint64 lump_size = SDL_SeekIO(lump, 0, SDL_IO_SEEK_END);
+  if (lump_size < 0) {
+    SDL_CloseIO(lump);
+    return false;
+  }
+  u64 lump_end = (u64)lump_size;
+
+  bool ok = true;
+  for (PackUpdate* u = updates.Begin(); u != updates.End() && ok; ++u) {
+    PackEntry* e = NULL;
+    PackEntry* found = pack.FindEntry(u->name);
+    if (found) {
+      e = &out[found - pack.entries.Begin()];
+    } else {
+      // May have been added by an earlier update
+      for (usize i = pack.entries.len; i < out.len; ++i) {
+        if (EntryNameEquals(out[i].name, u->name)) {
+          e = &out[i];
+        }
+      }
+    }
+
+    if (!e) {
+      if (!(ok = CheckEntryName(u->name, is_lb5))) {
+        break;
+      }
+      e = &out.buf[out.len++];
+      *e = { };
+      e->name = (char*)u->name;
+    }
+
+    if (lump_end + u->len > SDL_MAX_UINT32) {
+      ok = SDL_SetError("Archive would exceed 4 GiB");
+      break;
+    }
+
+    ok &= CopyIO(lump, u->src, u->len);
+
+    e->off = (u32)lump_end;
+    e->len = (u32)u->len;
+    lump_end += u->len;
+  }
+
+  ok &= SDL_CloseIO(lump);
+  if (!ok) {
+    return false;
+  }
+
+  return ReplacePackIDX(path, out, is_lb5);
+}
+
+static int SDLCALL CompareEntryOffsets(const void* a, const void* b)
+{
+  const PackEntry* ea = *(const PackEntry**)a;
+  const PackEntry* eb = *(const PackEntry**)b;
+  if (ea->off != eb->off) {
+    return ea->off < eb->off ? -1 : 1;
+  }
+  if (ea->len != eb->len) {
+    return ea->len < eb->len ? -1 : 1;
+  }
+  return 0;
+}
+
+bool CompactPackFile(const char* path)
+{
+  PackFile pack = { };
+  if (!OpenPackFile(&pack, path)) {
+    return false;
+  }
+  defer { pack.Close(); };
+
+  const bool is_lb5 = !SDL_strcasecmp(Extension(path), "lb5");
+  const usize count = pack.entries.len;
+
+  // Copy entries in their current lump order, so identical (off, len) pairs
+  // end up adjacent and can keep sharing their data
+  PackEntry** order = MemAlloc<PackEntry*>(Max<usize>(count, 1));
+  defer { MemFree(order); };
+  for (usize i = 0; i < count; ++i) {
+    order[i] = &pack.entries[i];
+  }
+  SDL_qsort(order, count, sizeof(PackEntry*), CompareEntryOffsets);
+
+  Span<PackEntry> out(MemAlloc<PackEntry>(Max<usize>(count, 1)), count);
+  defer { MemFree(out.buf); };
+  if (count > 0) {
+    SDL_memcpy(out.buf, pack.entries.buf, sizeof(PackEntry) * count);
+  }
+
+  char* idx_path = IdxPathFor(path);
+  defer { SDL_free(idx_path); };
+
+  char tmp_path[GOS_MAX_PATH];
+  char idx_tmp_path[GOS_MAX_PATH];
+  SDL_snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  SDL_snprintf(idx_tmp_path, sizeof(idx_tmp_path), "%s.tmp", idx_path);
+
+  SDL_IOStream* lump = SDL_IOFromFile(tmp_path, "wb");
+  if (!lump) {
+    return false;
+  }
+
+  bool ok = true;
+  u64 lump_len = 0;
+  const PackEntry* prev = NULL;
+  for (usize i = 0; i < count && ok; ++i) {
+    const PackEntry* e = order[i];
+    PackEntry* dst = &out[e - pack.entries.Begin()];
+    if (prev && prev->off == e->off && prev->len == e->len) {
+      dst->off = out[prev - pack.entries.Begin()].off;
+      continue;
+    }
+
+    SDL_IOStream* src = pack.OpenEntry(e);
+    ok = src && CopyIO(lump, src, e->len);
+    if (src) {
+      SDL_CloseIO(src);
+    }
+    dst->off = (u32)lump_len;
+    lump_len += e->len;
+    prev = e;
+  }
+
+  ok &= SDL_CloseIO(lump);
+  ok = ok && WritePackIDX(idx_tmp_path, out, is_lb5);
+
+  // The old lump has to be unmapped before it can be replaced
+  pack.Close();
+
+  // The two renames aren't atomic as a pair, so the old lump is kept as a
+  // backup until the new index is in place as well
+  char bak_path[GOS_MAX_PATH];
+  SDL_snprintf(bak_path, sizeof(bak_path), "%s.bak", path);
+  if (!ok || !SDL_RenameFile(path, bak_path)) {
+    DiscardTempFile(tmp_path);
+    DiscardTempFile(idx_tmp_path);
+    return false;
+  }
+  if (!SDL_RenameFile(tmp_path, path)) {
+    RestoreFile(bak_path, path);
+    DiscardTempFile(tmp_path);
+    DiscardTempFile(idx_tmp_path);
+    return false;
+  }
+  if (!SDL_RenameFile(idx_tmp_path, idx_path)) {
+    // Replaces the new lump, which is only referenced by the new index
+    RestoreFile(bak_path, path);
+    DiscardTempFile(idx_tmp_path);
+    return false;
+  }
+  SDL_RemovePath(bak_path);
+  return true;
+}
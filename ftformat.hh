@@ -14,21 +14,29 @@ struct Bitmap
   SDL_Texture* tex;
 };
 
-// Load 1997 bitmap
-bool LoadBP2(Bitmap* bmp, SDL_IOStream* src);
+// Bitmap loaders take their temporaries from arena if one is given, and reset
+// it to where it was before returning
 
-// Load 2006 bitmap
-bool LoadBP3(Bitmap* bmp, SDL_IOStream* src);
+// Load 1997 bitmap. Slices are decoded in parallel if pool is given
+bool LoadBP2(Bitmap* bmp, SDL_IOStream* src, ThreadPool* pool = NULL,
+             Arena* arena = NULL);
+
+// Load 2006 bitmap. Tile rows are decoded in parallel if pool is given.
+// format can be BGR24 or any 32-bit format with 8-bit channels
+bool LoadBP3(Bitmap* bmp, SDL_IOStream* src, ThreadPool* pool = NULL,
+             SDL_PixelFormat format = SDL_PIXELFORMAT_BGR24, Arena* arena = NULL);
 
 //-----------------------------------------------------------------------------
 // TXT files
 //-----------------------------------------------------------------------------
 
-// Load 1997 text as UTF-8
-char* DecodeTXT_1997(SDL_IOStream* io);
+// Load 1997 text as UTF-8. Text can contain NULs, so len is its real length.
+// The buffer is NUL-terminated past len. It is pushed onto arena if given,
+// otherwise freed with MemFree. Empty span with a NULL buf on error
+Span<char> DecodeTXT_1997(SDL_IOStream* io, Arena* arena = NULL);
 
-// Load 2006 text as UTF-8
-char* DecodeTXT_2006(SDL_IOStream* io, usize len = 0);
+// Load 2006 text as UTF-8, see DecodeTXT_1997
+Span<char> DecodeTXT_2006(SDL_IOStream* io, usize len = 0, Arena* arena = NULL);
 
 //-----------------------------------------------------------------------------
 // BIN/LB5 files
@@ -44,12 +52,74 @@ struct PackEntry
 struct PackFile
 {
   Span<PackEntry> entries;
-  SDL_IOStream*   lump_file;
+  char*           names;     // Storage for every entry name
+  MappedFile      lump_map;
+  SDL_IOStream*   lump_file; // Only opened if the lump can't be mapped
+  u64             lump_len;  // Size of lump_file
+
+  // Open-addressed name -> entry table. Slots hold entry index + 1, 0 is empty
+  u32*            index;
+  u32             index_mask;
+
+  void       Close();
+
+  // Copy an entry into a new buffer. Safe to call from multiple threads only
+  // if the lump is mapped or a stdio/Win32 file, see ReadIOAt
+  void*      ReadEntry(const PackEntry* entry);
+
+  // Open a read-only stream over just this entry, for reading large entries
+  // without holding them in memory. Each stream has its own cursor, so they
+  // can be used from multiple threads under the same conditions as
+  // ReadEntry. Close it with SDL_CloseIO
+  SDL_IOStream* OpenEntry(const PackEntry* entry);
 
-  void  Close();
-  void* ReadEntry(const PackEntry* entry);
+  // Case-insensitive lookup by name, NULL if not found
+  PackEntry* FindEntry(const char* name);
+
+  // View an entry's bytes directly in the read-only mapped lump. Returns an
+  // empty span if the lump isn't mapped, in which case use ReadEntry instead
+  Span<const u8> ViewEntry(const PackEntry* entry);
 };
 
 bool OpenPackFile(PackFile* pack, const char* path);
 
+// Builds a new .bin/.lb5 and its .idx. Entries are streamed into the lump as
+// they're added and the index is written by Finish
+struct PackWriter
+{
+  SDL_IOStream*   lump_file;
+  char*           lump_path;
+  bool            is_lb5;
+  u64             lump_len;
+  Span<PackEntry> entries;
+  u32             entries_cap;
+
+  // Copy len bytes from src into the lump as an entry called name
+  bool AddEntry(const char* name, SDL_IOStream* src, u64 len);
+
+  // Write the .idx and close everything
+  bool Finish();
+
+  // Close everything and delete the partially written lump
+  void Abort();
+};
+
+bool BeginPackFile(PackWriter* writer, const char* path);
+
+struct PackUpdate
+{
+  const char*   name;
+  SDL_IOStream* src;
+  u64           len;
+};
+
+// Replace or add entries in an existing archive without rebuilding it. New
+// data is appended to the lump and only the .idx is rewritten, so a failure
+// leaves the archive as it was. Replaced data stays behind as a gap until
+// CompactPackFile
+bool UpdatePackFile(const char* path, Span<PackUpdate> updates);
+
+// Rewrite an archive's lump without the gaps left behind by updates
+bool CompactPackFile(const char* path);
+
 #endif // _FTECH_FORMAT_H_
\ No newline at end of file
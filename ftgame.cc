@@ -79,15 +79,15 @@ int main(int argc, const char* argv[])
     return 1;
   }
 
-  char* script = DecodeTXT_1997(io);
-  if (!script) {
+  Span<char> script = DecodeTXT_1997(io);
+  if (!script.buf) {
     fprintf(stderr, "Error: %s\n", SDL_GetError());
     return 1;
   }
 
   SDL_CloseIO(io);
 
-  printf("SCRIPT:\n%s\n", script);
+  printf("SCRIPT:\n%s\n", script.buf);
   
   bmp.tex = SDL_CreateTextureFromSurface(rnd, bmp.surf);
   SDL_assert(bmp.tex);
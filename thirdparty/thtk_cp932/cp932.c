@@ -84,6 +84,55 @@ size_t cp932_to_utf8_len(
     }
     return len;
 }
+static char *
+put_utf8(
+    char *out,
+    unsigned short w)
+{
+    if (w & 0xF800) {
+        *out++ = 0xE0 | w>>12;
+        *out++ = 0x80 | w>>6 & 0x3F;
+        *out++ = 0x80 | w & 0x3F;
+    } else if (w & 0x0780) {
+        *out++ = 0xC0 | w>>6;
+        *out++ = 0x80 | w & 0x3F;
+    } else {
+        *out++ = w;
+    }
+    return out;
+}
+size_t cp932_to_utf8_run(
+    char *out,
+    const char *in,
+    size_t len,
+    size_t *consumed)
+{
+    char *origout = out;
+    size_t i = 0;
+    while (i < len) {
+        unsigned short w;
+        int ch = in[i] & 0xff;
+        /* A lead byte at the end gets a NUL second byte, like the
+         * NUL-terminated version would see */
+        int ch2 = i + 1 < len ? in[i + 1] & 0xff : 0;
+        if (ch < 0x80)
+            break;
+        if (cp932_inrange1(ch)) {
+            w = cp932_range1tab(ch)[ch2];
+            i += 2;
+        } else if (cp932_inrange2(ch)) {
+            w = cp932_range2tab(ch)[ch2];
+            i += 2;
+        } else {
+            w = cp932_to_ucs2_tab[ch];
+            i += 1;
+        }
+        out = put_utf8(out, w);
+    }
+    if (consumed)
+        *consumed = i < len ? i : len;
+    return out - origout;
+}
 #define utf8_cont_byte(ch) ((ch & 0xC0) == 0x80)
 char *
 utf8_to_cp932(
@@ -32,6 +32,16 @@ char *cp932_to_utf8(
     const char *in);
 size_t cp932_to_utf8_len(
     const char *in);
+/* Convert at most len bytes, NULs included, stopping before the next
+ * character that starts with an ASCII byte. out needs room for
+ * UTF8_PER_CP932 * len bytes. Returns the number of bytes written, with no
+ * terminator, and the number of input bytes used goes in consumed. Used by
+ * ShiftToUTF8Into in ftformat.cc, which copies the ASCII runs itself */
+size_t cp932_to_utf8_run(
+    char *out,
+    const char *in,
+    size_t len,
+    size_t *consumed);
 char *utf8_to_cp932(
     char *out,
     const char *in);